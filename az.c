@@ -16,12 +16,56 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <regex.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET 1  /* AVX2 code is built in and picked at run time */
+#endif
 
 #define VERSION "1.8.0"
 #define TAB_SIZE 4
-#define MAX_UNDO 100
+#define UNDO_BUDGET (32 * 1024 * 1024)  /* Bytes of undo/redo history kept */
+#define SYNTAX_BLOCK_LINES 256  /* Lines per syntax checkpoint */
+#define WRAP_BLOCK_LINES 256    /* Lines per visual-row index block */
+#define MATCH_BLOCK_LINES 256   /* Lines per search match index block */
+#define SYNTAX_DEBOUNCE_MS 150  /* Quiet time after an edit before validating */
+#define MESSAGE_TIMEOUT_MS 2000 /* How long a status message stays up */
+#define INPUT_BATCH_MS 50       /* Longest a burst of keys is applied before a frame is drawn */
 #define LINE_NUMBER_WIDTH 5
+#define ADD_CHUNK_SIZE (64 * 1024)
+#define PIECE_SLAB_NODES 4096   /* Piece nodes carved from one allocation */
+#define SAVE_IOV_BATCH 1024     /* Spans handed to one writev() - Linux's IOV_MAX */
+#define SAVE_LINK_DEPTH 32      /* Symlinks followed to find the file a save replaces */
+#define LOAD_FIRST_CHUNK (256 * 1024)       /* Indexed before the first frame */
+#define LOAD_CHUNK_SIZE (16 * 1024 * 1024)  /* Indexed per idle step afterwards */
+#define SEARCH_FAIL_SLACK 64   /* False prefilter hits allowed before Two-Way takes over */
+#define SEARCH_SAMPLE_SIZE (64 * 1024)  /* Text sampled to find the query's rarest bytes */
+#define SEARCH_CHUNK_SIZE (4 * 1024 * 1024)  /* Bytes scanned between keys while typing a query */
+#define SEARCH_CHUNK_HITS 65536          /* Earlier hits narrowed between keys */
+#define SEARCH_MAX_HITS (1 << 20)        /* Hits kept per query length for narrowing */
+#define SEARCH_RANGE_SIZE (16 * 1024 * 1024)  /* Bytes a search worker claims at a time */
+#define SEARCH_MAX_THREADS 64
+#define REGEX_MAX_INST 10000   /* NFA instructions a pattern may compile to */
+#define REGEX_MAX_REPEAT 1000  /* Largest {m,n} bound */
+#define REGEX_DFA_STATES 2048  /* Lazy DFA states cached before the cache starts over */
+#define REGEX_MAX_PREFIX 64    /* Literal prefix handed to the substring prefilter */
+#define PASTE_TIMEOUT_MS 1000  /* Quiet time that ends a paste whose end marker got lost */
+#define KEY_PASTE_START (KEY_MAX + 1)  /* Bracketed paste markers, ESC[200~ and ESC[201~ */
+#define KEY_PASTE_END (KEY_MAX + 2)
 #define DEBUG_LOG "/tmp/az_debug.log"
 
 /* Debug logging */
@@ -43,15 +87,306 @@ void debug_log(const char *fmt, ...) {
     }
 }
 
-/* Line structure */
-typedef struct Line {
+/* Self-pipe that wakes the main loop - written by signal handlers and the validation thread */
+int wake_pipe[2] = { -1, -1 };
+volatile sig_atomic_t resize_pending = 0;
+
+void wake_main_loop(void) {
+    if (wake_pipe[1] >= 0) {
+        int saved = errno;
+        char c = 0;
+        if (write(wake_pipe[1], &c, 1) < 0) {
+            /* Pipe full - the loop is already due to wake */
+        }
+        errno = saved;
+    }
+}
+
+static void handle_sigwinch(int sig) {
+    (void)sig;
+    resize_pending = 1;
+    wake_main_loop();
+}
+
+/* Text buffer - original file contents or one append-only add chunk */
+typedef struct TextBuf {
     char *data;
     size_t len;
     size_t capacity;
-    struct Line *next;
-    struct Line *prev;
+    uint32_t *newlines;     /* Offsets of every '\n' in data, ascending, low 32 bits */
+    size_t num_newlines;
+    size_t newlines_cap;
+    size_t *newlines_high;  /* Index of the first newline past each 4 GB of data */
+    size_t num_high;
+    size_t num_crlf;        /* Newlines preceded by '\r' */
+    int mapped;             /* data is a read-only mmap of the file */
+    struct TextBuf *next;   /* Previous add chunk */
+} TextBuf;
+
+/* Piece descriptor - a span of one text buffer */
+typedef struct {
+    TextBuf *buf;
+    size_t start;
+    size_t len;
+    size_t lf;              /* Newlines in this span */
+    size_t first_nl;        /* Index into buf->newlines of the first one */
+} Piece;
+
+/* Piece tree node - treap ordered by document position */
+typedef struct PieceNode {
+    Piece piece;
+    struct PieceNode *left;
+    struct PieceNode *right;
+    unsigned int priority;
+    size_t total_len;       /* Bytes in this subtree */
+    size_t total_lf;        /* Newlines in this subtree */
+} PieceNode;
+
+/* Slab of piece nodes - handed out in order, recycled through a free list */
+typedef struct PieceSlab {
+    struct PieceSlab *next;
+    size_t used;
+    PieceNode nodes[PIECE_SLAB_NODES];
+} PieceSlab;
+
+/* Tree under construction from pieces given in document order */
+typedef struct {
+    PieceNode **spine;      /* Right spine, root first */
+    size_t depth;
+    size_t cap;
+} PieceBuilder;
+
+/* Spans queued for one writev() while saving */
+typedef struct {
+    int fd;
+    struct iovec iov[SAVE_IOV_BATCH];
+    int count;
+    int error;              /* errno of the first failed write, 0 if none */
+} SaveWriter;
+
+/* Undo log entry - one primitive edit; deleted text is kept as pieces */
+typedef struct {
+    enum { UNDO_INSERT, UNDO_DELETE, UNDO_REPLACE } type;
+    size_t offset;
+    size_t len;
+    Piece *pieces;          /* UNDO_DELETE: the removed spans, in order; UNDO_REPLACE: the whole other version */
+    size_t num_pieces;
+} UndoOp;
+
+/* Undo step - the edits made since one save_undo() call */
+typedef struct {
+    UndoOp *ops;
+    size_t num_ops;
+    size_t ops_cap;
+    size_t bytes;           /* Heap held by ops and their pieces */
+    int cursor_x;           /* Cursor before the step */
+    int cursor_y;
+    int redo_x;             /* Cursor after the step, set when it is undone */
+    int redo_y;
+} UndoGroup;
+
+/* Line view - points into a text buffer, or into scratch if the line spans pieces */
+typedef struct {
+    const char *data;
+    size_t len;
+    char *scratch;
+    size_t scratch_cap;
 } Line;
 
+/* Regex NFA instructions, parse tree nodes and DFA state flags */
+enum { RE_BYTE, RE_SPLIT, RE_JUMP, RE_BOL, RE_EOL, RE_MATCH };
+enum { RN_EMPTY, RN_SET, RN_CAT, RN_ALT, RN_REPEAT, RN_BOL, RN_EOL };
+enum { RE_ACCEPT = 1, RE_ACCEPT_EOL = 2, RE_START = 4, RE_DEAD = 8 };
+
+/* One instruction of a compiled regex */
+typedef struct {
+    int op;
+    int out;                /* Next instruction */
+    int alt;                /* Other branch of RE_SPLIT */
+    int set;                /* Byte set of RE_BYTE */
+} RegexInst;
+
+/* Parsed regex - a tree of nodes over byte sets */
+typedef struct {
+    int type;
+    int a, b;               /* Operands */
+    int min, max;           /* RN_REPEAT bounds, max -1 = unbounded */
+    int set;                /* RN_SET */
+} RegexNode;
+
+typedef struct {
+    const char *p;
+    const char *end;
+    RegexNode *nodes;
+    int num_nodes;
+    int nodes_cap;
+    unsigned char *sets;    /* 32-byte bitmaps */
+    int num_sets;
+    int sets_cap;
+    const char *error;
+} RegexParser;
+
+/* Live instructions of a simulation step - a sparse set */
+typedef struct {
+    int *pcs;
+    size_t *starts;         /* Where each thread's match began */
+    int *where;             /* Position of an instruction in pcs */
+    int count;
+} RegexList;
+
+/* Lazily built DFA state: a sorted set of NFA instructions */
+typedef struct {
+    int first;              /* Its instructions in the pool */
+    int count;
+    unsigned hash;
+    int flags;              /* RE_ACCEPT, RE_ACCEPT_EOL, RE_START, RE_DEAD */
+} RegexState;
+
+/*
+ * Compiled regular expression.  The scan runs a DFA built lazily from the
+ * NFA - one state per distinct set of live instructions, cached until the
+ * cache fills up and starts over - to where the first match ends.  A DFA
+ * of the reversed pattern reads back from there to where a match could
+ * begin, and only that stretch goes through the NFA for the exact match.
+ * None of the steps backtracks.
+ */
+typedef struct Regex {
+    RegexInst *prog;
+    int num_inst;
+    unsigned char *sets;    /* 32-byte bitmaps, '\n' in none */
+    int num_sets;
+    unsigned char classes[256];  /* Bytes no set tells apart share a class */
+    int num_classes;
+    int has_prefix;         /* The finder's needle starts every match */
+    int reverse;            /* Reversed pattern: no restarts, anchors taken to hold */
+    struct Regex *rev;      /* The reversed pattern of a forward one */
+    unsigned char first[32];  /* Bytes a match can begin with */
+    
+    RegexState *states;
+    int num_states;
+    int states_cap;
+    int *trans;             /* Next state per state and class, -1 = not built yet */
+    int *pool;              /* Instructions of every state */
+    int pool_len;
+    int pool_cap;
+    int *table;             /* Hash of states, -1 = empty */
+    int start_bol;          /* Unanchored start at a line start */
+    int start_mid;          /* ...and anywhere else */
+    unsigned resets;        /* Times the cache started over */
+    
+    RegexList lists[3];     /* Scratch */
+    int *stack;
+    int *key;
+    const char *cur_data;   /* Piece the last byte read came from */
+    size_t cur_base;
+    size_t cur_end;
+} Regex;
+
+/*
+ * Compiled substring query.  The scan looks for the two rarest needle
+ * bytes at their offsets a vector at a time and compares the whole needle
+ * only where both agree; Two-Way takes over when that keeps failing.
+ */
+typedef struct {
+    char *needle;
+    size_t len;
+    size_t rare1;           /* Offsets of the two rarest needle bytes */
+    size_t rare2;
+    size_t split;           /* Two-Way critical factorization */
+    size_t period;
+    int periodic;
+    int tuned;              /* Prefilter bytes picked from the document's own byte counts */
+    size_t shift[256];      /* Two-Way skip by the last byte of the window */
+    char *stitch;           /* Bytes around a piece boundary */
+    Regex *re;              /* Regex query - needle is then its literal prefix */
+    size_t found_len;       /* Length of the match doc_find() last reported */
+} Finder;
+
+/* Matches of one query length during as-you-type search */
+typedef struct {
+    Finder finder;
+    size_t *hits;           /* Match offsets in scan order (forward from the origin, wrapping) */
+    size_t num_hits;
+    size_t hits_cap;
+    size_t count;           /* Matches found, kept or not */
+    int overflow;           /* Too many to keep - a longer query scans afresh */
+    int narrowing;          /* Still filtering a shorter query's hits */
+    int base;               /* Length of that shorter query */
+    size_t filtered;        /* Its hits filtered so far */
+    int phase;              /* 0: origin to end, 1: top to origin, 2: done */
+    size_t pos;             /* Scan resumes here */
+    const char *error;      /* Why the regex does not compile */
+} SearchLevel;
+
+/* Matches in a run of lines */
+typedef struct {
+    int lines;
+    int count;              /* Matches in the block (-1 = rescan) */
+    size_t *hits;           /* Match offsets from the start of the block's first line */
+    int hits_cap;
+} MatchBlock;
+
+/*
+ * Every match of the last search query, in blocks of lines under two
+ * Fenwick trees (lines and matches per block), so the match after the
+ * cursor and its number are logarithmic lookups.  Hits are offsets within
+ * their block, so edits elsewhere never touch them; an edit rescans only
+ * the blocks it touched.
+ */
+typedef struct {
+    Finder finder;
+    int active;             /* finder holds an indexed query */
+    MatchBlock *blocks;
+    int num_blocks;
+    int blocks_cap;
+    int *tree_lines;
+    int *tree_hits;
+    int *dirty;             /* Blocks waiting for a rescan */
+    int num_dirty;
+    int dirty_cap;
+    int stale;              /* Block list changed - rebuild the trees */
+} MatchIndex;
+
+/* Run of lines in the visual-row index */
+typedef struct {
+    int lines;
+    int extra;              /* Screen rows beyond one per line (-1 = recount) */
+    int *wide;              /* (line in block, extra rows) pairs of the lines that wrap */
+    int num_wide;
+    int wide_cap;
+} WrapBlock;
+
+/*
+ * Screen rows per line under word wrap.  Blocks of lines sit under two
+ * Fenwick trees (lines and rows per block), so the row of a line and the
+ * line at a row are logarithmic lookups.  An edit re-counts only the
+ * blocks it touched; a new wrap width re-counts everything.
+ */
+typedef struct {
+    WrapBlock *blocks;
+    int num_blocks;
+    int blocks_cap;
+    int *tree_lines;        /* 1-based Fenwick trees over the blocks */
+    int *tree_rows;
+    int *dirty;             /* Blocks waiting for a recount */
+    int num_dirty;
+    int dirty_cap;
+    int width;              /* Wrap width counted for (0 = rebuild) */
+    int stale;              /* Block list changed - rebuild the trees */
+} WrapIndex;
+
+/* Text rows as of the last frame - rows whose hash still matches are not redrawn */
+typedef struct {
+    unsigned long long *rows;   /* Content hash per screen row (0 = unknown) */
+    int num_rows;
+    int width;
+    int top;                    /* Visual row the rows were drawn from */
+    chtype *cells;              /* Row being composed */
+    int cells_cap;
+    unsigned long drawn;
+    unsigned long skipped;
+} RenderCache;
+
 /* Syntax error info */
 typedef struct {
     int line;       /* Error line number (1-based) */
@@ -60,14 +395,120 @@ typedef struct {
     char msg[128];  /* Error message */
 } SyntaxError;
 
+/* Languages the syntax checker knows */
+enum { SYNTAX_NONE, SYNTAX_JSON, SYNTAX_YAML, SYNTAX_PYTHON, SYNTAX_HTML, SYNTAX_C };
+
+/* Lexer state carried from one line to the next */
+typedef struct {
+    int brace;              /* Open '{' (JSON, C family) */
+    int bracket;            /* Open '[' (JSON) */
+    int tag_depth;          /* Open tags (HTML/XML) */
+    int in_string;
+    int in_comment;         /* Inside a block comment (C family, HTML) */
+} LexState;
+
+/* Result of scanning a block of lines from one set of entry flags */
+typedef struct {
+    LexState entry;         /* Flags before the first line (depths are 0) */
+    LexState exit;          /* Flags after the last line, depth changes */
+    LexState low;           /* Lowest depths reached inside the block */
+    SyntaxError error;      /* First error, line relative to the block (0 = none) */
+    int first_tab;          /* Python: first TAB / space indented line, block relative */
+    int first_space;
+    int first_mixed;        /* Python: first line indented with both */
+} SyntaxScan;
+
+/*
+ * Checkpointed run of lines.  Depths are kept relative to the block
+ * entry, so a scan is reused while the text and the entry string /
+ * comment flags are unchanged, whatever the nesting depth above it.
+ * Two scans are kept so an opening quote followed by its closing one
+ * does not rescan the rest of the file twice.
+ */
+typedef struct {
+    int lines;
+    int dirty;              /* Text changed since the last scan */
+    int num_scans;
+    SyntaxScan scans[2];    /* Most recently used first */
+} SyntaxBlock;
+
+/* Line change for the checkpoints: line y absorbed removed lines, then gained added */
+typedef struct {
+    int y;
+    int removed;
+    int added;
+} SyntaxEdit;
+
+/* Validation request - an immutable view of the document for the worker */
+typedef struct {
+    Piece *pieces;          /* Document order, lf/first_nl valid per span */
+    size_t num_pieces;
+    size_t *lf_before;      /* Newlines before each piece */
+    TextBuf active;         /* Copy of the add chunk still being written to */
+    int total_lines;
+    int lang;
+    unsigned long revision;
+    SyntaxEdit *edits;      /* Line changes since the previous job */
+    int num_edits;
+    int rebuild;            /* Edits went untracked - start the checkpoints over */
+} SyntaxJob;
+
+/*
+ * Syntax validation state.  Checkpoint blocks belong to whoever runs the
+ * current job (the worker thread, or the caller of check_syntax_error()
+ * once the worker is idle); the main thread only queues line edits for
+ * them.  Fields under "shared" are guarded by lock.
+ */
+typedef struct {
+    /* Checkpoints - owned by the job runner */
+    SyntaxBlock *blocks;
+    int num_blocks;
+    int blocks_cap;
+    int *tree_lines;        /* 1-based Fenwick tree of block line counts */
+    int stale;              /* Block list changed - rebuild the tree */
+    int lang;
+    
+    /* Main thread */
+    SyntaxEdit *edits;      /* Line changes not yet handed to a job */
+    int num_edits;
+    int edits_cap;
+    int tracking;           /* Checkpoints exist - keep queueing edits */
+    unsigned long revision; /* Document revision of syntax_error */
+    int checked_lang;       /* Language of syntax_error */
+    long long due_ms;       /* Pending validation deadline (0 = none) */
+    int debounce_ms;
+    unsigned long runs;     /* Validations executed */
+    unsigned long skipped;  /* Requests answered without validating */
+    
+    /* Shared */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int started;
+    int busy;               /* A job is queued or running */
+    int done;               /* result holds a finished job */
+    int quit;
+    SyntaxJob job;
+    SyntaxError result;
+} SyntaxIndex;
+
 /* Editor state */
 typedef struct {
-    Line *first_line;
-    Line *current_line;
+    /* Piece table */
+    TextBuf orig;           /* Original file contents (never modified) */
+    TextBuf *add;           /* Newest add chunk, older ones chained via next */
+    PieceNode *pieces;      /* Piece tree root */
+    size_t load_pos;        /* Bytes of orig indexed into the document so far */
+    size_t load_end;        /* Bytes of orig that belong to the document */
+    const char *eol;        /* Line terminator for new lines: "\n" or "\r\n" */
+    const char *final_eol;  /* Terminator written after the last line ("" if none) */
+    unsigned long revision; /* Bumped by every change to the document text */
+    
     int cursor_x;
     int cursor_y;
     int preferred_x;  /* For PageUp/Down */
     int offset_y;
+    int offset_wrap;  /* First visible row of line offset_y when it wraps */
     int screen_width;
     int screen_height;
     int edit_width;
@@ -76,10 +517,15 @@ typedef struct {
     int modified;
     int total_lines;
     char message[256];
-    int message_timeout;
+    long long message_until; /* Monotonic ms when the message is taken down */
     
     /* Syntax error */
     SyntaxError syntax_error;
+    SyntaxIndex syntax;
+    
+    RenderCache render;
+    WrapIndex wrap;
+    MatchIndex matches;
     
     /* Selection */
     int sel_active;
@@ -97,28 +543,39 @@ typedef struct {
     char **cut_buffer;
     int cut_buffer_lines;
     
-    /* Undo/Redo - properly implemented */
-    struct {
-        char **lines;
-        int num_lines;
-        int cursor_x;
-        int cursor_y;
-    } undo_stack[MAX_UNDO];
+    /* Undo/Redo - ring of edit logs: undo_count applied steps, then redo_count undone ones */
+    UndoGroup *history;
+    int history_cap;
+    int history_start;      /* Ring slot of the oldest step */
     int undo_count;
-    
-    struct {
-        char **lines;
-        int num_lines;
-        int cursor_x;
-        int cursor_y;
-    } redo_stack[MAX_UNDO];
     int redo_count;
+    size_t undo_bytes;      /* Heap held by the whole history */
+    size_t undo_budget;     /* Oldest steps are evicted beyond this */
+    int undo_replaying;     /* Applying logged edits - do not log them again */
+    int undo_pending;       /* save_undo() called - the step opens with the next logged edit */
+    int undo_pending_x;     /* Cursor at that call */
+    int undo_pending_y;
 } Editor;
 
+/* Whole-document scan shared by search workers, one byte range at a time */
+typedef struct {
+    Editor *ed;
+    const Finder *finder;   /* Each worker scans with its own copy */
+    size_t total;
+    size_t num_ranges;
+    size_t next;            /* Next range to claim */
+    pthread_mutex_t lock;
+    size_t *counts;         /* Matches per range */
+    size_t **hits;          /* Their offsets per range, NULL when only counting */
+} SearchPool;
+
 /* Function declarations */
 void init_editor(Editor *ed, const char *filename);
 void cleanup_editor(Editor *ed);
 void load_file(Editor *ed, const char *filename);
+int load_more(Editor *ed, size_t budget);
+void load_finish(Editor *ed);
+int doc_save(Editor *ed, const char *filename);
 void save_file(Editor *ed);
 void draw_screen(Editor *ed);
 void handle_input(Editor *ed, int ch);
@@ -130,27 +587,64 @@ void move_cursor(Editor *ed, int dy, int dx);
 void page_up(Editor *ed);
 void page_down(Editor *ed);
 void set_message(Editor *ed, const char *msg);
+void handle_resize(Editor *ed);
+void wake_main_loop(void);
 void copy_selection(Editor *ed);
 void cut_selection(Editor *ed);
+void insert_text(Editor *ed, const char *text, size_t len);
+void insert_lines(Editor *ed, char **lines, int count);
+void paste_terminal(Editor *ed);
 void paste_clipboard(Editor *ed);
 void cut_line(Editor *ed);
 void uncut_text(Editor *ed);
 void select_all(Editor *ed);
 void delete_selection(Editor *ed);
 void handle_mouse(Editor *ed);
-Line* get_line_at(Editor *ed, int y);
+int get_line_at(Editor *ed, int y, Line *line);
+void line_release(Line *line);
+size_t line_offset(Editor *ed, int y);
+int line_at_offset(Editor *ed, size_t offset);
+size_t line_length(Editor *ed, int y);
+int line_rows(Editor *ed, int y);
+int visual_row(Editor *ed, int y);
+int visual_line_at(Editor *ed, int row, int *wrap);
+void scroll_to_cursor(Editor *ed);
+size_t doc_length(Editor *ed);
+void doc_read(Editor *ed, size_t offset, size_t len, char *dst);
+void doc_insert(Editor *ed, size_t offset, const char *text, size_t len);
+void doc_delete(Editor *ed, size_t offset, size_t len);
+void doc_replace_all(Editor *ed, const size_t *hits, size_t count, size_t len, const char *text, size_t text_len);
+PieceNode* piece_at(Editor *ed, size_t offset, size_t *piece_offset);
+void free_pieces(PieceNode *node);
 void check_syntax_error(Editor *ed);
+int syntax_service(Editor *ed);
+int syntax_poll(Editor *ed);
+void syntax_wait(Editor *ed);
+void request_syntax_check(Editor *ed);
+long long now_ms(void);
 void handle_tab(Editor *ed);
 void search_text(Editor *ed);
+void search_next(Editor *ed, int dir);
+int match_start(Editor *ed, const char *query, size_t len, int regex);
+void match_stop(Editor *ed);
+int match_current(Editor *ed, int *total);
 void replace_text(Editor *ed);
 void save_undo(Editor *ed);
 void perform_undo(Editor *ed);
+void perform_redo(Editor *ed);
 char* safe_strndup(const char *s, size_t n);
+void finder_init(Finder *f, const char *needle, size_t len);
+int finder_init_regex(Finder *f, const char *pattern, size_t len, const char **error);
+void finder_free(Finder *f);
+const char* finder_find(const Finder *f, const char *hay, size_t len);
+int doc_find(Editor *ed, Finder *f, size_t from, size_t to, size_t *at);
+size_t finder_match_len(Editor *ed, Finder *f, size_t at);
+size_t doc_find_all(Editor *ed, Finder *f, size_t **hits, int threads);
+int search_threads(void);
 
-/* Safe string duplicate with length limit */
+/* Safe string duplicate with length limit (s need not be NUL-terminated) */
 char* safe_strndup(const char *s, size_t n) {
-    size_t len = strlen(s);
-    if (len > n) len = n;
+    size_t len = strnlen(s, n);
     char *result = malloc(len + 1);
     if (result) {
         memcpy(result, s, len);
@@ -159,579 +653,4150 @@ char* safe_strndup(const char *s, size_t n) {
     return result;
 }
 
-/* Initialize editor */
-void init_editor(Editor *ed, const char *filename) {
-    debug_log("=== AZ Editor Started ===");
-    debug_log("Filename: %s", filename ? filename : "NULL");
-    memset(ed, 0, sizeof(Editor));
-    
-    /* Create first line */
-    ed->first_line = calloc(1, sizeof(Line));
-    ed->first_line->capacity = 128;
-    ed->first_line->data = calloc(ed->first_line->capacity, 1);
-    ed->current_line = ed->first_line;
-    ed->total_lines = 1;
-    
-    if (filename) {
-        ed->filename = strdup(filename);
-        load_file(ed, filename);
+/*
+ * Substring search
+ *
+ * Buffers carry explicit lengths, so the scan never depends on a NUL.
+ * The prefilter compares the needle's two rarest bytes (by a sample of
+ * the document) at their offsets against 64 (AVX2) or 16 (SSE2) haystack
+ * positions per step and runs a full compare only where both agree - on
+ * text this skips almost every position at memory speed.  Needles of
+ * common bytes over repetitive text can make the prefilter fire
+ * constantly; once false hits outnumber one per 16 bytes the rest of the
+ * haystack goes to Two-Way, which is linear in the worst case.  The
+ * vector width is chosen from the CPU at run time.
+ */
+
+/* Rough order of byte frequency in source and log text, most common first */
+static size_t byte_weight(unsigned char c) {
+    static const char order[] = " e\nta\toisnrlcdhu0m1p2fg.,_=-\"/:y3b5w4v6987k(x)"
+                                "ETASIRCNOLDMPjq;zUF'BGHW<>[]{}*XVKYJQZ";
+    const char *p = c ? strchr(order, c) : NULL;
+    return p ? sizeof(order) - (p - order) : 0;
+}
+
+/* Prefilter on the rarest needle byte, then the rarest other byte value if there is one */
+static void finder_pick(Finder *f, const size_t *weight) {
+    const unsigned char *n = (const unsigned char *)f->needle;
+    f->rare1 = 0;
+    for (size_t i = 1; i < f->len; i++) {
+        if (weight[n[i]] < weight[n[f->rare1]]) f->rare1 = i;
     }
-    
-    /* Initialize ncurses */
-    initscr();
-    debug_log("ncurses initialized");
-    
-    raw();  /* Use raw() to get ALL keys including Ctrl */
-    debug_log("raw() called");
-    
-    keypad(stdscr, TRUE);
-    debug_log("keypad enabled");
-    
-    noecho();
-    debug_log("noecho set");
-    
-    /* Disable flow control so Ctrl+S/Q work */
-    intrflush(stdscr, FALSE);
-    debug_log("intrflush disabled");
-    
-    timeout(50);
-    debug_log("timeout set to 50ms");
-    
-    /* Colors */
-    if (has_colors()) {
-        start_color();
-        use_default_colors();
-        init_pair(1, COLOR_CYAN, -1);     /* Line numbers */
-        init_pair(2, COLOR_GREEN, -1);    /* Comments */
-        init_pair(3, COLOR_YELLOW, -1);   /* Strings */
-        init_pair(4, COLOR_MAGENTA, -1);  /* Keywords */
-        init_pair(5, COLOR_BLACK, COLOR_WHITE);  /* Selection */
-        init_pair(6, COLOR_WHITE, COLOR_BLUE);   /* Status bar */
-        init_pair(7, COLOR_RED, -1);      /* Errors */
+    f->rare2 = (f->rare1 == 0 && f->len > 1) ? 1 : 0;
+    for (size_t i = 0; i < f->len; i++) {
+        if (i == f->rare1) continue;
+        int differs = n[i] != n[f->rare1];
+        int best_differs = n[f->rare2] != n[f->rare1];
+        if (differs > best_differs || (differs == best_differs && weight[n[i]] < weight[n[f->rare2]])) {
+            f->rare2 = i;
+        }
     }
-    
-    /* Mouse support */
-    mousemask(ALL_MOUSE_EVENTS | REPORT_MOUSE_POSITION, NULL);
-    mouseinterval(0);
-    
-    /* Enable mouse motion events in terminal */
-    printf("\033[?1003h");  /* Enable any-event mouse tracking */
-    fflush(stdout);
-    
-    /* Get screen size */
-    getmaxyx(stdscr, ed->screen_height, ed->screen_width);
-    ed->edit_height = ed->screen_height - 2;
-    ed->edit_width = ed->screen_width - LINE_NUMBER_WIDTH - 1;
-    
-    /* We need to ignore signals for Ctrl keys to work */
-    signal(SIGINT, SIG_IGN);   /* Ignore Ctrl+C */
-    signal(SIGTSTP, SIG_IGN);  /* Ignore Ctrl+Z */
-    signal(SIGQUIT, SIG_IGN);  /* Ignore Ctrl+\ */
-    debug_log("Signals ignored");
 }
 
-/* Load file */
-void load_file(Editor *ed, const char *filename) {
-    FILE *f = fopen(filename, "r");
-    if (!f) return;
-    
-    /* Free existing lines */
-    Line *line = ed->first_line;
-    while (line) {
-        Line *next = line->next;
-        free(line->data);
-        free(line);
-        line = next;
+/* Re-pick the prefilter bytes by how often they occur in the text itself */
+static void finder_tune(Finder *f, const char *sample, size_t len) {
+    size_t weight[256] = {0};
+    if (len > SEARCH_SAMPLE_SIZE) len = SEARCH_SAMPLE_SIZE;
+    for (size_t i = 0; i < len; i++) {
+        weight[(unsigned char)sample[i]] += 128;
     }
-    
-    ed->first_line = NULL;
-    ed->current_line = NULL;
-    ed->total_lines = 0;
-    
-    char buffer[8192];
-    Line *last_line = NULL;
-    
-    while (fgets(buffer, sizeof(buffer), f)) {
-        /* Remove newline */
-        size_t len = strlen(buffer);
-        if (len > 0 && buffer[len-1] == '\n') {
-            buffer[len-1] = '\0';
-            len--;
+    for (int c = 0; c < 256; c++) {
+        weight[c] += byte_weight(c);  /* Breaks ties */
+    }
+    finder_pick(f, weight);
+    f->tuned = 1;
+}
+
+/* Start of the maximal suffix of n (under byte order, or its reverse) minus one */
+static size_t twoway_suffix(const unsigned char *n, size_t len, int reverse, size_t *period) {
+    size_t ip = (size_t)-1, jp = 0, k = 1, p = 1;
+    while (jp + k < len) {
+        unsigned char a = n[ip + k], b = n[jp + k];
+        if (a == b) {
+            if (k == p) {
+                jp += p;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if (reverse ? a < b : a > b) {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        } else {
+            ip = jp++;
+            k = p = 1;
         }
-        if (len > 0 && buffer[len-1] == '\r') {
-            buffer[len-1] = '\0';
-            len--;
+    }
+    *period = p;
+    return ip;
+}
+
+/* Crochemore-Perrin Two-Way search - linear time, constant space */
+static const char* find_twoway(const Finder *f, const char *hay, size_t len) {
+    const unsigned char *n = (const unsigned char *)f->needle;
+    const unsigned char *h = (const unsigned char *)hay;
+    const unsigned char *end = h + len;
+    size_t l = f->len;
+    size_t mem0 = f->periodic ? l - f->period : 0;
+    size_t mem = 0;
+    
+    while ((size_t)(end - h) >= l) {
+        /* Skip windows whose last byte cannot line up with the needle */
+        size_t k = l - f->shift[h[l - 1]];
+        if (k) {
+            h += k < mem ? mem : k;
+            mem = 0;
+            continue;
         }
-        
-        /* Create new line */
-        Line *new_line = calloc(1, sizeof(Line));
-        new_line->capacity = len + 128;
-        new_line->data = malloc(new_line->capacity);
-        strcpy(new_line->data, buffer);
-        new_line->len = len;
-        
-        if (!ed->first_line) {
-            ed->first_line = new_line;
-            ed->current_line = new_line;
-        } else {
-            last_line->next = new_line;
-            new_line->prev = last_line;
+        /* Right half first, then the left half */
+        for (k = f->split > mem ? f->split : mem; k < l && n[k] == h[k]; k++);
+        if (k < l) {
+            h += k - f->split + 1;
+            mem = 0;
+            continue;
         }
-        last_line = new_line;
-        ed->total_lines++;
+        for (k = f->split; k > mem && n[k - 1] == h[k - 1]; k--);
+        if (k <= mem) return (const char *)h;
+        h += f->period;
+        mem = mem0;
     }
-    
-    fclose(f);
-    
-    if (!ed->first_line) {
-        ed->first_line = calloc(1, sizeof(Line));
-        ed->first_line->capacity = 128;
-        ed->first_line->data = calloc(ed->first_line->capacity, 1);
-        ed->current_line = ed->first_line;
-        ed->total_lines = 1;
+    return NULL;
+}
+
+/* Candidates from pos on, one memchr for the rarest byte at a time */
+static const char* find_tail(const Finder *f, const char *hay, size_t len, size_t pos) {
+    size_t count = len - f->len + 1;
+    const char *key = hay + f->rare1;
+    char b1 = f->needle[f->rare1];
+    char b2 = f->needle[f->rare2];
+    size_t fails = 0;
+    while (pos < count) {
+        const char *hit = memchr(key + pos, b1, count - pos);
+        if (!hit) return NULL;
+        pos = hit - key;
+        if (hay[pos + f->rare2] == b2 && memcmp(hay + pos, f->needle, f->len) == 0) return hay + pos;
+        pos++;
+        if (++fails > SEARCH_FAIL_SLACK + pos / 16) return find_twoway(f, hay + pos, len - pos);
     }
+    return NULL;
 }
 
-/* Save file */
-void save_file(Editor *ed) {
-    if (!ed->filename) {
-        /* Prompt for filename */
-        echo();
-        curs_set(2);
-        mvprintw(ed->screen_height - 1, 0, "Fayl nomi: ");
-        clrtoeol();
-        refresh();
-        
-        char filename[256];
-        getnstr(filename, sizeof(filename) - 1);
-        
-        noecho();
-        curs_set(1);
-        
-        if (strlen(filename) > 0) {
-            ed->filename = strdup(filename);
-        } else {
-            set_message(ed, "Cancelled");
-            return;
+#ifdef __SSE2__
+static const char* find_sse2(const Finder *f, const char *hay, size_t len) {
+    size_t count = len - f->len + 1;   /* Start positions to try */
+    const __m128i b1 = _mm_set1_epi8(f->needle[f->rare1]);
+    const __m128i b2 = _mm_set1_epi8(f->needle[f->rare2]);
+    size_t pos = 0, fails = 0;
+    while (count - pos >= 16) {
+        const __m128i *k1 = (const __m128i *)(hay + pos + f->rare1);
+        const __m128i *k2 = (const __m128i *)(hay + pos + f->rare2);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(k1), b1)) &
+                        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(k2), b2));
+        while (mask) {
+            size_t i = pos + __builtin_ctz(mask);
+            if (memcmp(hay + i, f->needle, f->len) == 0) return hay + i;
+            fails++;
+            mask &= mask - 1;
         }
+        pos += 16;
+        if (fails > SEARCH_FAIL_SLACK + pos / 16) return find_twoway(f, hay + pos, len - pos);
     }
-    
-    FILE *f = fopen(ed->filename, "w");
-    if (!f) {
-        set_message(ed, "Error: Cannot open file");
+    return find_tail(f, hay, len, pos);
+}
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+__attribute__((target("avx2")))
+static const char* find_avx2(const Finder *f, const char *hay, size_t len) {
+    size_t count = len - f->len + 1;
+    const __m256i b1 = _mm256_set1_epi8(f->needle[f->rare1]);
+    const __m256i b2 = _mm256_set1_epi8(f->needle[f->rare2]);
+    size_t pos = 0, fails = 0;
+    while (count - pos >= 64) {
+        const __m256i *k1 = (const __m256i *)(hay + pos + f->rare1);
+        const __m256i *k2 = (const __m256i *)(hay + pos + f->rare2);
+        __m256i lo = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256(k1), b1),
+                                      _mm256_cmpeq_epi8(_mm256_loadu_si256(k2), b2));
+        __m256i hi = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256(k1 + 1), b1),
+                                      _mm256_cmpeq_epi8(_mm256_loadu_si256(k2 + 1), b2));
+        if (_mm256_testz_si256(_mm256_or_si256(lo, hi), _mm256_or_si256(lo, hi))) {
+            pos += 64;
+            continue;
+        }
+        unsigned long long mask = (unsigned)_mm256_movemask_epi8(lo) |
+                                  ((unsigned long long)(unsigned)_mm256_movemask_epi8(hi) << 32);
+        while (mask) {
+            size_t i = pos + __builtin_ctzll(mask);
+            if (memcmp(hay + i, f->needle, f->len) == 0) return hay + i;
+            fails++;
+            mask &= mask - 1;
+        }
+        pos += 64;
+        if (fails > SEARCH_FAIL_SLACK + pos / 16) return find_twoway(f, hay + pos, len - pos);
+    }
+    return find_tail(f, hay, len, pos);
+}
+#endif
+
+#ifndef __SSE2__
+static const char* find_plain(const Finder *f, const char *hay, size_t len) {
+    return find_tail(f, hay, len, 0);
+}
+#endif
+
+/* Widest scan this CPU runs - picked on first use */
+static const char* (*find_scan)(const Finder *f, const char *hay, size_t len);
+
+static void find_select(void) {
+#ifdef HAVE_AVX2_TARGET
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_scan = find_avx2;
+        debug_log("search: AVX2 scan");
         return;
     }
-    
-    Line *line = ed->first_line;
-    while (line) {
-        fprintf(f, "%s\n", line->data);
-        line = line->next;
+#endif
+#ifdef __SSE2__
+    find_scan = find_sse2;
+    debug_log("search: SSE2 scan");
+#else
+    find_scan = find_plain;
+    debug_log("search: memchr scan");
+#endif
+}
+
+/*
+ * Regular expressions
+ *
+ * Literals, '.', [classes] with ranges and negation, \d \w \s and their
+ * negations, ^ and $ at the ends of lines, (groups), | and the quantifiers
+ * * + ? {m} {m,} {m,n}.  A match is the leftmost-longest one, at least a
+ * byte long and within one line.
+ */
+
+static int regex_node(RegexParser *ps, int type, int a, int b) {
+    if (ps->num_nodes == ps->nodes_cap) {
+        ps->nodes_cap = ps->nodes_cap ? ps->nodes_cap * 2 : 32;
+        ps->nodes = realloc(ps->nodes, sizeof(RegexNode) * ps->nodes_cap);
+    }
+    RegexNode *node = &ps->nodes[ps->num_nodes];
+    memset(node, 0, sizeof(RegexNode));
+    node->type = type;
+    node->a = a;
+    node->b = b;
+    return ps->num_nodes++;
+}
+
+/* A new empty byte set */
+static unsigned char* regex_new_set(RegexParser *ps, int *index) {
+    if (ps->num_sets == ps->sets_cap) {
+        ps->sets_cap = ps->sets_cap ? ps->sets_cap * 2 : 16;
+        ps->sets = realloc(ps->sets, 32 * ps->sets_cap);
+    }
+    unsigned char *set = ps->sets + 32 * ps->num_sets;
+    memset(set, 0, 32);
+    *index = ps->num_sets++;
+    return set;
+}
+
+static void regex_set_range(unsigned char *set, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) {
+        set[c >> 3] |= 1 << (c & 7);
+    }
+}
+
+static int regex_has(const unsigned char *set, int c) {
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+/* Add the bytes of \d \w \s (or \D \W \S) to set; 0 if c names none of them */
+static int regex_class_escape(unsigned char *set, int c) {
+    unsigned char bytes[32] = {0};
+    switch (tolower(c)) {
+    case 'd':
+        regex_set_range(bytes, '0', '9');
+        break;
+    case 'w':
+        regex_set_range(bytes, '0', '9');
+        regex_set_range(bytes, 'A', 'Z');
+        regex_set_range(bytes, 'a', 'z');
+        regex_set_range(bytes, '_', '_');
+        break;
+    case 's':
+        regex_set_range(bytes, ' ', ' ');
+        regex_set_range(bytes, '\t', '\t');
+        regex_set_range(bytes, '\v', '\f');
+        break;
+    default:
+        return 0;
+    }
+    if (isupper(c)) {
+        /* Negations stop at the line end like '.' does */
+        for (int i = 0; i < 32; i++) {
+            bytes[i] = ~bytes[i];
+        }
+        bytes['\r' >> 3] &= ~(1 << ('\r' & 7));
+    }
+    for (int i = 0; i < 32; i++) {
+        set[i] |= bytes[i];
+    }
+    return 1;
+}
+
+/* Byte an escape stands for, -1 if it is not one */
+static int regex_escape_byte(int c) {
+    switch (c) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    }
+    return isalnum(c) ? -1 : c;
+}
+
+/* [...] - the '[' is already read */
+static int regex_parse_class(RegexParser *ps) {
+    int index;
+    unsigned char *set = regex_new_set(ps, &index);
+    int negate = (ps->p < ps->end && *ps->p == '^');
+    if (negate) ps->p++;
+    
+    for (int first = 1; ; first = 0) {
+        if (ps->p >= ps->end) {
+            ps->error = "Missing ]";
+            return -1;
+        }
+        int lo = (unsigned char)*ps->p++;
+        if (lo == ']' && !first) break;
+        if (lo == '\\') {
+            if (ps->p >= ps->end) {
+                ps->error = "Missing ]";
+                return -1;
+            }
+            int c = (unsigned char)*ps->p++;
+            if (regex_class_escape(set, c)) continue;
+            if ((lo = regex_escape_byte(c)) < 0) {
+                ps->error = "Unknown escape";
+                return -1;
+            }
+        }
+        int hi = lo;
+        if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+            hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && ps->p < ps->end) hi = regex_escape_byte((unsigned char)*ps->p++);
+            if (hi < lo) {
+                ps->error = "Bad range";
+                return -1;
+            }
+        }
+        regex_set_range(set, lo, hi);
     }
     
-    fclose(f);
-    ed->modified = 0;
-    
-    char msg[256];
-    snprintf(msg, sizeof(msg), "Saqlandi: %s", ed->filename);
-    set_message(ed, msg);
+    if (negate) {
+        for (int i = 0; i < 32; i++) {
+            set[i] = ~set[i];
+        }
+        set['\r' >> 3] &= ~(1 << ('\r' & 7));
+    }
+    int n = regex_node(ps, RN_SET, 0, 0);
+    ps->nodes[n].set = index;
+    return n;
+}
+
+static int regex_parse_alt(RegexParser *ps);
+
+/* A byte, a class, an anchor or a group */
+static int regex_parse_atom(RegexParser *ps) {
+    int c = (unsigned char)*ps->p++;
+    int index;
+    unsigned char *set;
+    switch (c) {
+    case '(': {
+        int n = regex_parse_alt(ps);
+        if (n < 0) return -1;
+        if (ps->p >= ps->end || *ps->p != ')') {
+            ps->error = "Missing )";
+            return -1;
+        }
+        ps->p++;
+        return n;
+    }
+    case '[':
+        return regex_parse_class(ps);
+    case '^':
+        return regex_node(ps, RN_BOL, 0, 0);
+    case '$':
+        return regex_node(ps, RN_EOL, 0, 0);
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+        ps->error = "Nothing to repeat";
+        return -1;
+    case '.':
+        set = regex_new_set(ps, &index);
+        memset(set, 0xff, 32);
+        set['\r' >> 3] &= ~(1 << ('\r' & 7));
+        break;
+    case '\\':
+        if (ps->p >= ps->end) {
+            ps->error = "Trailing \\";
+            return -1;
+        }
+        c = (unsigned char)*ps->p++;
+        set = regex_new_set(ps, &index);
+        if (!regex_class_escape(set, c)) {
+            int b = regex_escape_byte(c);
+            if (b < 0) {
+                ps->error = "Unknown escape";
+                return -1;
+            }
+            regex_set_range(set, b, b);
+        }
+        break;
+    default:
+        set = regex_new_set(ps, &index);
+        regex_set_range(set, c, c);
+    }
+    int n = regex_node(ps, RN_SET, 0, 0);
+    ps->nodes[n].set = index;
+    return n;
+}
+
+/* Decimal number, -1 if there is none */
+static int regex_number(RegexParser *ps) {
+    if (ps->p >= ps->end || !isdigit((unsigned char)*ps->p)) return -1;
+    int n = 0;
+    while (ps->p < ps->end && isdigit((unsigned char)*ps->p)) {
+        if (n <= REGEX_MAX_REPEAT) n = n * 10 + (*ps->p - '0');
+        ps->p++;
+    }
+    return n;
+}
+
+/* An atom and its quantifiers */
+static int regex_parse_repeat(RegexParser *ps) {
+    int n = regex_parse_atom(ps);
+    while (n >= 0 && ps->p < ps->end) {
+        int min, max;
+        if (*ps->p == '*') {
+            min = 0;
+            max = -1;
+        } else if (*ps->p == '+') {
+            min = 1;
+            max = -1;
+        } else if (*ps->p == '?') {
+            min = 0;
+            max = 1;
+        } else if (*ps->p == '{') {
+            ps->p++;
+            min = max = regex_number(ps);
+            if (ps->p < ps->end && *ps->p == ',') {
+                ps->p++;
+                max = regex_number(ps);
+            }
+            if (min < 0 || ps->p >= ps->end || *ps->p != '}' ||
+                min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT || (max >= 0 && max < min)) {
+                ps->error = "Bad {m,n}";
+                return -1;
+            }
+        } else {
+            break;
+        }
+        ps->p++;
+        int r = regex_node(ps, RN_REPEAT, n, 0);
+        ps->nodes[r].min = min;
+        ps->nodes[r].max = max;
+        n = r;
+    }
+    return n;
+}
+
+static int regex_parse_cat(RegexParser *ps) {
+    int n = regex_node(ps, RN_EMPTY, 0, 0);
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        int r = regex_parse_repeat(ps);
+        if (r < 0) return -1;
+        n = regex_node(ps, RN_CAT, n, r);
+    }
+    return n;
+}
+
+static int regex_parse_alt(RegexParser *ps) {
+    int n = regex_parse_cat(ps);
+    while (n >= 0 && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        int r = regex_parse_cat(ps);
+        if (r < 0) return -1;
+        n = regex_node(ps, RN_ALT, n, r);
+    }
+    return n;
+}
+
+/* Append the literal text every match of node n starts with; 0 once the text stops being fixed */
+static int regex_prefix(const RegexParser *ps, int n, char *buf, size_t *len) {
+    const RegexNode *node = &ps->nodes[n];
+    switch (node->type) {
+    case RN_EMPTY:
+    case RN_BOL:
+        return 1;
+    case RN_CAT:
+        return regex_prefix(ps, node->a, buf, len) && regex_prefix(ps, node->b, buf, len);
+    case RN_SET: {
+        const unsigned char *set = ps->sets + 32 * node->set;
+        int only = -1;
+        for (int c = 0; c < 256; c++) {
+            if (!regex_has(set, c)) continue;
+            if (only >= 0) return 0;
+            only = c;
+        }
+        if (only < 0 || *len == REGEX_MAX_PREFIX) return 0;
+        buf[(*len)++] = only;
+        return 1;
+    }
+    case RN_REPEAT:
+        for (int i = 0; i < node->min; i++) {
+            if (!regex_prefix(ps, node->a, buf, len)) return 0;
+        }
+        return node->min == node->max;
+    }
+    return 0;
+}
+
+/* The tree of the pattern read backwards */
+static int regex_reverse(RegexParser *ps, int n) {
+    RegexNode node = ps->nodes[n];
+    int a, b, r;
+    switch (node.type) {
+    case RN_CAT:
+        b = regex_reverse(ps, node.b);
+        a = regex_reverse(ps, node.a);
+        return regex_node(ps, RN_CAT, b, a);
+    case RN_ALT:
+        a = regex_reverse(ps, node.a);
+        b = regex_reverse(ps, node.b);
+        return regex_node(ps, RN_ALT, a, b);
+    case RN_REPEAT:
+        a = regex_reverse(ps, node.a);
+        r = regex_node(ps, RN_REPEAT, a, 0);
+        ps->nodes[r].min = node.min;
+        ps->nodes[r].max = node.max;
+        return r;
+    case RN_BOL:
+        return regex_node(ps, RN_EOL, 0, 0);
+    case RN_EOL:
+        return regex_node(ps, RN_BOL, 0, 0);
+    }
+    return n;
+}
+
+static int regex_emit(Regex *re, int op) {
+    if (re->num_inst == REGEX_MAX_INST) return -1;
+    RegexInst *in = &re->prog[re->num_inst];
+    in->op = op;
+    in->out = re->num_inst + 1;
+    in->alt = -1;
+    in->set = -1;
+    return re->num_inst++;
+}
+
+/* Thompson construction for node n; 0 if the program grows too large */
+static int regex_compile(Regex *re, const RegexNode *nodes, int n) {
+    const RegexNode *node = &nodes[n];
+    int split, jump;
+    switch (node->type) {
+    case RN_SET:
+        if ((split = regex_emit(re, RE_BYTE)) < 0) return 0;
+        re->prog[split].set = node->set;
+        return 1;
+    case RN_BOL:
+        return regex_emit(re, RE_BOL) >= 0;
+    case RN_EOL:
+        return regex_emit(re, RE_EOL) >= 0;
+    case RN_CAT:
+        return regex_compile(re, nodes, node->a) && regex_compile(re, nodes, node->b);
+    case RN_ALT:
+        if ((split = regex_emit(re, RE_SPLIT)) < 0 || !regex_compile(re, nodes, node->a)) return 0;
+        if ((jump = regex_emit(re, RE_JUMP)) < 0) return 0;
+        re->prog[split].alt = re->num_inst;
+        if (!regex_compile(re, nodes, node->b)) return 0;
+        re->prog[jump].out = re->num_inst;
+        return 1;
+    case RN_REPEAT:
+        for (int i = 0; i < node->min; i++) {
+            if (!regex_compile(re, nodes, node->a)) return 0;
+        }
+        if (node->max < 0) {
+            if ((split = regex_emit(re, RE_SPLIT)) < 0 || !regex_compile(re, nodes, node->a)) return 0;
+            if ((jump = regex_emit(re, RE_JUMP)) < 0) return 0;
+            re->prog[jump].out = split;
+            re->prog[split].alt = re->num_inst;
+            return 1;
+        }
+        for (int i = node->min; i < node->max; i++) {
+            if ((split = regex_emit(re, RE_SPLIT)) < 0 || !regex_compile(re, nodes, node->a)) return 0;
+            re->prog[split].alt = re->num_inst;
+        }
+        return 1;
+    }
+    return 1;
+}
+
+/* Program for the tree at root, or for it reversed; NULL if it grows too large */
+static Regex* regex_build(RegexParser *ps, int root, int reverse) {
+    Regex *re = calloc(1, sizeof(Regex));
+    re->reverse = reverse;
+    re->prog = malloc(sizeof(RegexInst) * REGEX_MAX_INST);
+    if (reverse) root = regex_reverse(ps, root);
+    if (!regex_compile(re, ps->nodes, root) || regex_emit(re, RE_MATCH) < 0) {
+        free(re->prog);
+        free(re);
+        return NULL;
+    }
+    re->prog = realloc(re->prog, sizeof(RegexInst) * re->num_inst);
+    re->sets = malloc(32 * ps->num_sets + 1);
+    if (ps->num_sets > 0) memcpy(re->sets, ps->sets, 32 * ps->num_sets);
+    re->num_sets = ps->num_sets;
+    return re;
+}
+
+/* Add pc and everything it reaches without reading a byte; bol and eol say which anchors hold here */
+static void regex_close(Regex *re, RegexList *l, int pc, size_t start, int bol, int eol) {
+    int top = 0;
+    re->stack[top++] = pc;
+    while (top > 0) {
+        pc = re->stack[--top];
+        int k = l->where[pc];
+        if (k < l->count && l->pcs[k] == pc) continue;
+        l->where[pc] = l->count;
+        l->pcs[l->count] = pc;
+        l->starts[l->count++] = start;
+        
+        const RegexInst *in = &re->prog[pc];
+        if (in->op == RE_SPLIT) {
+            re->stack[top++] = in->alt;
+            re->stack[top++] = in->out;
+        } else if (in->op == RE_JUMP || (in->op == RE_BOL && bol) || (in->op == RE_EOL && eol)) {
+            re->stack[top++] = in->out;
+        }
+    }
+}
+
+static int regex_cmp(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static void regex_reset(Regex *re);
+
+/* The DFA state for the instructions in l, made if it is new */
+static int regex_intern(Regex *re, RegexList *l) {
+    if (re->num_states == REGEX_DFA_STATES) regex_reset(re);
+    
+    /* Only instructions that read a byte or end a match tell states apart */
+    int n = 0, flags = 0;
+    for (int k = 0; k < l->count; k++) {
+        int op = re->prog[l->pcs[k]].op;
+        if (op == RE_BYTE || op == RE_EOL || op == RE_MATCH) re->key[n++] = l->pcs[k];
+        if (op == RE_MATCH) flags |= RE_ACCEPT;
+    }
+    if (n == 0) flags |= RE_DEAD;
+    qsort(re->key, n, sizeof(int), regex_cmp);
+    unsigned hash = 2166136261u;
+    for (int k = 0; k < n; k++) {
+        hash = (hash ^ re->key[k]) * 16777619u;
+    }
+    
+    unsigned mask = REGEX_DFA_STATES * 2 - 1;
+    unsigned slot = hash & mask;
+    for (; re->table[slot] >= 0; slot = (slot + 1) & mask) {
+        const RegexState *st = &re->states[re->table[slot]];
+        if (st->hash == hash && st->count == n && memcmp(re->pool + st->first, re->key, sizeof(int) * n) == 0) {
+            return re->table[slot];
+        }
+    }
+    
+    /* A match that needs a line end right after it */
+    RegexList *eol = &re->lists[2];
+    eol->count = 0;
+    for (int k = 0; k < n; k++) {
+        if (re->prog[re->key[k]].op == RE_EOL) regex_close(re, eol, re->prog[re->key[k]].out, 0, 0, 1);
+    }
+    for (int k = 0; k < eol->count; k++) {
+        if (re->prog[eol->pcs[k]].op == RE_MATCH) flags |= RE_ACCEPT_EOL;
+    }
+    
+    if (re->num_states == re->states_cap) {
+        re->states_cap = re->states_cap ? re->states_cap * 2 : 64;
+        re->states = realloc(re->states, sizeof(RegexState) * re->states_cap);
+        re->trans = realloc(re->trans, sizeof(int) * re->states_cap * re->num_classes);
+    }
+    if (re->pool_len + n > re->pool_cap) {
+        re->pool_cap = (re->pool_len + n) * 2;
+        re->pool = realloc(re->pool, sizeof(int) * re->pool_cap);
+    }
+    int s = re->num_states++;
+    RegexState *st = &re->states[s];
+    st->first = re->pool_len;
+    st->count = n;
+    st->hash = hash;
+    st->flags = flags;
+    memcpy(re->pool + re->pool_len, re->key, sizeof(int) * n);
+    re->pool_len += n;
+    for (int c = 0; c < re->num_classes; c++) {
+        re->trans[s * re->num_classes + c] = -1;
+    }
+    re->table[slot] = s;
+    return s;
+}
+
+/* Empty the DFA cache down to the start states */
+static void regex_reset(Regex *re) {
+    re->num_states = 0;
+    re->pool_len = 0;
+    re->resets++;
+    for (int i = 0; i < REGEX_DFA_STATES * 2; i++) {
+        re->table[i] = -1;
+    }
+    RegexList *l = &re->lists[1];
+    l->count = 0;
+    if (re->reverse) {
+        /* Reading back from a match end - the match may be anywhere in the pattern there */
+        for (int pc = 0; pc < re->num_inst; pc++) {
+            regex_close(re, l, pc, 0, 1, 1);
+        }
+        re->start_bol = re->start_mid = regex_intern(re, l);
+        return;
+    }
+    regex_close(re, l, 0, 0, 1, 0);
+    re->start_bol = regex_intern(re, l);
+    l->count = 0;
+    regex_close(re, l, 0, 0, 0, 0);
+    re->start_mid = regex_intern(re, l);
+    if (re->has_prefix) {
+        /* Nothing under way - the prefilter can skip ahead */
+        re->states[re->start_bol].flags |= RE_START;
+        re->states[re->start_mid].flags |= RE_START;
+    }
+}
+
+/* Build the transition from state s on byte c */
+static int regex_next(Regex *re, int s, int c) {
+    RegexList *l = &re->lists[0];
+    l->count = 0;
+    const RegexState *st = &re->states[s];
+    for (int k = 0; k < st->count; k++) {
+        const RegexInst *in = &re->prog[re->pool[st->first + k]];
+        if (in->op == RE_BYTE && regex_has(re->sets + 32 * in->set, c)) {
+            regex_close(re, l, in->out, 0, re->reverse, re->reverse);
+        }
+    }
+    /* Unanchored - a match may start right after c as well */
+    if (!re->reverse) regex_close(re, l, 0, 0, c == '\n', 0);
+    
+    unsigned resets = re->resets;
+    int next = regex_intern(re, l);
+    if (re->resets == resets) re->trans[s * re->num_classes + re->classes[c]] = next;
+    return next;
+}
+
+/* Bytes no set tells apart share a class - one DFA column each */
+static void regex_classes(Regex *re) {
+    memset(re->classes, 0, sizeof(re->classes));
+    int count = 1;
+    /* '\n' restarts the scan at a line start, so it gets a class of its own */
+    for (int s = -1; s < re->num_sets; s++) {
+        int remap[512];
+        memset(remap, -1, sizeof(remap));
+        count = 0;
+        for (int c = 0; c < 256; c++) {
+            int in = (s < 0) ? c == '\n' : regex_has(re->sets + 32 * s, c) != 0;
+            int key = re->classes[c] * 2 + in;
+            if (remap[key] < 0) remap[key] = count++;
+            re->classes[c] = remap[key];
+        }
+    }
+    re->num_classes = count;
+}
+
+/* Scratch and an empty DFA cache for a compiled program */
+static void regex_prepare(Regex *re) {
+    regex_classes(re);
+    for (int i = 0; i < 3; i++) {
+        re->lists[i].pcs = malloc(sizeof(int) * re->num_inst);
+        re->lists[i].starts = malloc(sizeof(size_t) * re->num_inst);
+        re->lists[i].where = calloc(re->num_inst, sizeof(int));
+        re->lists[i].count = 0;
+    }
+    re->stack = malloc(sizeof(int) * (re->num_inst * 2 + 1));
+    re->key = malloc(sizeof(int) * re->num_inst);
+    re->table = malloc(sizeof(int) * REGEX_DFA_STATES * 2);
+    
+    RegexList *l = &re->lists[0];
+    l->count = 0;
+    regex_close(re, l, 0, 0, 1, 1);
+    memset(re->first, 0, sizeof(re->first));
+    for (int k = 0; k < l->count; k++) {
+        const RegexInst *in = &re->prog[l->pcs[k]];
+        if (in->op != RE_BYTE) continue;
+        for (int i = 0; i < 32; i++) {
+            re->first[i] |= re->sets[32 * in->set + i];
+        }
+    }
+    regex_reset(re);
+}
+
+static void regex_free(Regex *re) {
+    if (!re) return;
+    regex_free(re->rev);
+    free(re->prog);
+    free(re->sets);
+    free(re->states);
+    free(re->trans);
+    free(re->pool);
+    free(re->table);
+    for (int i = 0; i < 3; i++) {
+        free(re->lists[i].pcs);
+        free(re->lists[i].starts);
+        free(re->lists[i].where);
+    }
+    free(re->stack);
+    free(re->key);
+    free(re);
+}
+
+/* Same program, cache of its own */
+static Regex* regex_clone(const Regex *src) {
+    Regex *re = calloc(1, sizeof(Regex));
+    re->prog = malloc(sizeof(RegexInst) * src->num_inst);
+    memcpy(re->prog, src->prog, sizeof(RegexInst) * src->num_inst);
+    re->num_inst = src->num_inst;
+    re->sets = malloc(32 * src->num_sets + 1);
+    memcpy(re->sets, src->sets, 32 * src->num_sets);
+    re->num_sets = src->num_sets;
+    re->has_prefix = src->has_prefix;
+    re->reverse = src->reverse;
+    if (src->rev) re->rev = regex_clone(src->rev);
+    regex_prepare(re);
+    return re;
+}
+
+/* Compile a query: pick the prefilter bytes and factorize for Two-Way */
+void finder_init(Finder *f, const char *needle, size_t len) {
+    if (!find_scan) find_select();
+    
+    memset(f, 0, sizeof(Finder));
+    f->needle = malloc(len + 1);
+    memcpy(f->needle, needle, len);
+    f->needle[len] = '\0';
+    f->len = len;
+    f->stitch = malloc(len * 2 + 1);
+    if (len == 0) return;
+    
+    size_t weight[256];
+    for (int c = 0; c < 256; c++) {
+        weight[c] = byte_weight(c);
+    }
+    finder_pick(f, weight);
+    
+    const unsigned char *n = (const unsigned char *)f->needle;
+    /* Critical factorization: the later of the two maximal suffixes */
+    size_t p1, p2;
+    size_t ms = twoway_suffix(n, len, 0, &p1);
+    size_t ms2 = twoway_suffix(n, len, 1, &p2);
+    size_t period = p1;
+    if (ms2 + 1 > ms + 1) {
+        ms = ms2;
+        period = p2;
+    }
+    f->split = ms + 1;
+    if (memcmp(n, n + period, f->split) == 0) {
+        f->periodic = 1;
+        f->period = period;
+    } else {
+        f->period = (f->split - 1 > len - f->split ? f->split - 1 : len - f->split) + 1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        f->shift[n[i]] = i + 1;
+    }
+}
+
+/* Compile a regex query; 0 with *error set if the pattern is not valid */
+int finder_init_regex(Finder *f, const char *pattern, size_t len, const char **error) {
+    RegexParser ps;
+    memset(&ps, 0, sizeof(RegexParser));
+    ps.p = pattern;
+    ps.end = pattern + len;
+    int root = regex_parse_alt(&ps);
+    if (root >= 0 && ps.p < ps.end) ps.error = "Unmatched )";
+    
+    Regex *re = NULL;
+    char prefix[REGEX_MAX_PREFIX];
+    size_t prefix_len = 0;
+    if (!ps.error) {
+        /* Matches stay within a line */
+        for (int i = 0; i < ps.num_sets; i++) {
+            ps.sets[32 * i + ('\n' >> 3)] &= ~(1 << ('\n' & 7));
+        }
+        regex_prefix(&ps, root, prefix, &prefix_len);
+        re = regex_build(&ps, root, 0);
+        if (re) re->rev = regex_build(&ps, root, 1);
+        if (!re || !re->rev) ps.error = "Regex too long";
+    }
+    if (!ps.error) {
+        re->has_prefix = prefix_len > 0;
+        regex_prepare(re);
+        regex_prepare(re->rev);
+        
+        /* An empty match would be found at every position */
+        RegexList *l = &re->lists[0];
+        l->count = 0;
+        regex_close(re, l, 0, 0, 1, 1);
+        for (int k = 0; k < l->count; k++) {
+            if (re->prog[l->pcs[k]].op == RE_MATCH) ps.error = "Matches empty text";
+        }
+    }
+    free(ps.nodes);
+    free(ps.sets);
+    if (ps.error) {
+        regex_free(re);
+        *error = ps.error;
+        return 0;
+    }
+    
+    finder_init(f, prefix, prefix_len);
+    f->re = re;
+    debug_log("regex: %d instructions, %d byte classes, prefix '%.*s'", re->num_inst, re->num_classes, (int)prefix_len, prefix);
+    return 1;
+}
+
+void finder_free(Finder *f) {
+    free(f->needle);
+    free(f->stitch);
+    regex_free(f->re);
+    f->needle = NULL;
+    f->stitch = NULL;
+    f->re = NULL;
+}
+
+/* First match in a length-delimited buffer, or NULL */
+const char* finder_find(const Finder *f, const char *hay, size_t len) {
+    if (f->len == 0 || f->len > len) return NULL;
+    if (f->len == 1) return memchr(hay, f->needle[0], len);
+    return find_scan(f, hay, len);
+}
+
+/*
+ * First occurrence of the needle within [from, to).  Each piece is
+ * scanned in place as one block; only the few bytes around a piece
+ * boundary are copied so matches that straddle it are found too.
+ */
+static int find_literal(Editor *ed, Finder *f, size_t from, size_t to, size_t *at) {
+    size_t total = doc_length(ed);
+    if (total > to) total = to;
+    size_t pos = from;
+    if (f->len == 0) return 0;
+    
+    while (pos + f->len <= total) {
+        size_t piece_offset;
+        PieceNode *node = piece_at(ed, pos, &piece_offset);
+        if (!node) return 0;
+        size_t skip = pos - piece_offset;
+        const char *data = node->piece.buf->data + node->piece.start + skip;
+        size_t span = node->piece.len - skip;
+        if (span > total - pos) span = total - pos;
+        if (!f->tuned) finder_tune(f, data, span);
+        
+        const char *hit = finder_find(f, data, span);
+        if (hit) {
+            *at = pos + (hit - data);
+            return 1;
+        }
+        
+        size_t piece_end = pos + span;
+        if (piece_end >= total) return 0;
+        if (f->len > 1) {
+            size_t lo = (piece_end - pos >= f->len - 1) ? piece_end - (f->len - 1) : pos;
+            size_t hi = (total - piece_end >= f->len - 1) ? piece_end + (f->len - 1) : total;
+            doc_read(ed, lo, hi - lo, f->stitch);
+            hit = finder_find(f, f->stitch, hi - lo);
+            if (hit) {
+                *at = lo + (hit - f->stitch);
+                return 1;
+            }
+        }
+        pos = piece_end;
+    }
+    return 0;
+}
+
+/* Byte at offset, read through the piece it last came from; -1 past the end */
+static int regex_byte(Editor *ed, Regex *re, size_t offset) {
+    if (offset < re->cur_base || offset >= re->cur_end) {
+        size_t piece_offset;
+        PieceNode *node = (offset < doc_length(ed)) ? piece_at(ed, offset, &piece_offset) : NULL;
+        if (!node) return -1;
+        re->cur_data = node->piece.buf->data + node->piece.start;
+        re->cur_base = piece_offset;
+        re->cur_end = piece_offset + node->piece.len;
+    }
+    return (unsigned char)re->cur_data[offset - re->cur_base];
+}
+
+static int regex_start(Editor *ed, Regex *re, size_t pos) {
+    return (pos == 0 || regex_byte(ed, re, pos - 1) == '\n') ? re->start_bol : re->start_mid;
+}
+
+/*
+ * Where the first match to finish ends, for matches in [from, to).  The
+ * DFA reads each byte once; while no match is under way the substring
+ * prefilter skips to the next place the literal prefix occurs.
+ */
+static int regex_scan(Editor *ed, Finder *f, size_t from, size_t to, size_t *end) {
+    Regex *re = f->re;
+    size_t pos = from;
+    int s = regex_start(ed, re, pos);
+    
+    while (pos < to) {
+        size_t piece_offset;
+        PieceNode *node = piece_at(ed, pos, &piece_offset);
+        if (!node) return 0;
+        size_t skip = pos - piece_offset;
+        const unsigned char *data = (const unsigned char *)node->piece.buf->data + node->piece.start + skip;
+        size_t span = node->piece.len - skip;
+        if (span > to - pos) span = to - pos;
+        
+        size_t i = 0;
+        for (; i < span; i++) {
+            int flags = re->states[s].flags;
+            if (flags) {
+                if ((flags & RE_ACCEPT) || ((flags & RE_ACCEPT_EOL) && (data[i] == '\n' || data[i] == '\r'))) {
+                    *end = pos + i;
+                    return 1;
+                }
+                if (flags & RE_START) break;
+            }
+            int next = re->trans[s * re->num_classes + re->classes[data[i]]];
+            s = (next >= 0) ? next : regex_next(re, s, data[i]);
+        }
+        pos += i;
+        
+        if (i < span) {
+            /* Skip to the prefix and read its first byte, so the scan moves on even if it starts here */
+            size_t at;
+            if (!find_literal(ed, f, pos, to, &at)) return 0;
+            s = regex_start(ed, re, at);
+            int c = regex_byte(ed, re, at);
+            int next = re->trans[s * re->num_classes + re->classes[c]];
+            s = (next >= 0) ? next : regex_next(re, s, c);
+            pos = at + 1;
+        }
+    }
+    
+    int flags = re->states[s].flags;
+    int c = regex_byte(ed, re, to);
+    if ((flags & RE_ACCEPT) || ((flags & RE_ACCEPT_EOL) && (c < 0 || c == '\n' || c == '\r'))) {
+        *end = to;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Leftmost-longest match starting in [from, to) and ending by to, by NFA
+ * simulation: each thread remembers where its match began, and once one
+ * matches only threads that began no later keep running.  An anchored
+ * run only starts a thread at from.
+ */
+static int regex_pike(Editor *ed, Regex *re, size_t from, size_t to, int anchored, size_t *start, size_t *end) {
+    RegexList *run = &re->lists[0], *next = &re->lists[1];
+    run->count = 0;
+    int found = 0;
+    int prev = (from == 0) ? '\n' : regex_byte(ed, re, from - 1);
+    int c = regex_byte(ed, re, from);
+    
+    for (size_t i = from; ; i++) {
+        if (run->count == 0 && !found && !anchored) {
+            /* Nothing under way - skip to a byte a match can begin with */
+            while (i < to && c >= 0 && !regex_has(re->first, c)) {
+                prev = c;
+                c = regex_byte(ed, re, ++i);
+            }
+        }
+        if (!found && i < to && (!anchored || i == from)) {
+            regex_close(re, run, 0, i, prev == '\n', c < 0 || c == '\n' || c == '\r');
+        }
+        int step = (i < to && c >= 0);
+        int after = step ? regex_byte(ed, re, i + 1) : -1;
+        next->count = 0;
+        for (int k = 0; k < run->count; k++) {
+            size_t began = run->starts[k];
+            if (found && began > *start) break;  /* Threads run in order of their start */
+            const RegexInst *in = &re->prog[run->pcs[k]];
+            if (in->op == RE_MATCH) {
+                if (i > began && (!found || began < *start || i > *end)) {
+                    *start = began;
+                    *end = i;
+                    found = 1;
+                }
+            } else if (in->op == RE_BYTE && step && regex_has(re->sets + 32 * in->set, c)) {
+                regex_close(re, next, in->out, began, 0, after < 0 || after == '\n' || after == '\r');
+            }
+        }
+        if (!step || (next->count == 0 && (found || anchored))) break;
+        
+        RegexList *swap = run;
+        run = next;
+        next = swap;
+        prev = c;
+        c = after;
+    }
+    return found;
+}
+
+/*
+ * Reading back from end with the reversed pattern: the leftmost place
+ * from which a match could have been under way at end.
+ */
+static size_t regex_back(Editor *ed, Regex *rev, size_t from, size_t end) {
+    int s = rev->start_bol;
+    size_t lo = end;
+    for (size_t i = end; i > from; i--) {
+        int c = regex_byte(ed, rev, i - 1);
+        int next = rev->trans[s * rev->num_classes + rev->classes[c]];
+        s = (next >= 0) ? next : regex_next(rev, s, c);
+        int flags = rev->states[s].flags;
+        if (flags & RE_DEAD) break;
+        if (flags & RE_ACCEPT) lo = i - 1;
+    }
+    return lo;
+}
+
+/* First regex match in [from, to) */
+static int regex_find(Editor *ed, Finder *f, size_t from, size_t to, size_t *at) {
+    size_t total = doc_length(ed);
+    if (to > total) to = total;
+    f->re->cur_end = 0;  /* The text may have changed since the last search */
+    size_t end;
+    if (from >= to || !regex_scan(ed, f, from, to, &end)) return 0;
+    
+    /* The leftmost match ends no earlier, so it began no later than the back scan reaches */
+    f->re->rev->cur_end = 0;
+    size_t start = regex_back(ed, f->re->rev, from, end);
+    if (!regex_pike(ed, f->re, start, to, 0, &start, &end)) return 0;
+    *at = start;
+    f->found_len = end - start;
+    return 1;
+}
+
+/* First match lying within [from, to); f->found_len gets its length */
+int doc_find(Editor *ed, Finder *f, size_t from, size_t to, size_t *at) {
+    if (f->re) return regex_find(ed, f, from, to, at);
+    f->found_len = f->len;
+    return find_literal(ed, f, from, to, at);
+}
+
+/* Length of the match at offset at */
+size_t finder_match_len(Editor *ed, Finder *f, size_t at) {
+    if (!f->re) return f->len;
+    size_t start, end;
+    f->re->cur_end = 0;
+    return regex_pike(ed, f->re, at, doc_length(ed), 1, &start, &end) ? end - start : 0;
+}
+
+/* Where a scan for the next match resumes - literal matches may overlap, regex ones do not */
+static size_t finder_resume(const Finder *f, size_t at) {
+    return at + (f->re ? f->found_len : 1);
+}
+
+/* Copy for another thread - doc_find() writes into the stitch buffer and the regex cache */
+static void finder_clone(Finder *dst, const Finder *src) {
+    *dst = *src;
+    dst->needle = malloc(src->len + 1);
+    memcpy(dst->needle, src->needle, src->len + 1);
+    dst->stitch = malloc(src->len * 2 + 1);
+    if (src->re) dst->re = regex_clone(src->re);
+}
+
+/* Start of range r - regex ranges start on a line so matches never straddle them */
+static size_t search_range_edge(SearchPool *pool, const Finder *f, size_t r) {
+    size_t edge = r * SEARCH_RANGE_SIZE;
+    if (edge >= pool->total) return pool->total;
+    if (!f->re || edge == 0) return edge;
+    int y = line_at_offset(pool->ed, edge);
+    size_t start = line_offset(pool->ed, y);
+    return (start == edge) ? edge : line_offset(pool->ed, y + 1);
+}
+
+/* Claim ranges until none are left; a range owns the matches starting in it */
+static void* search_worker(void *arg) {
+    SearchPool *pool = arg;
+    Finder f;
+    finder_clone(&f, pool->finder);
+    
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        size_t r = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (r >= pool->num_ranges) break;
+        
+        size_t start = search_range_edge(pool, &f, r);
+        size_t end = search_range_edge(pool, &f, r + 1);
+        /* Read on past the end so a match straddling it still belongs here */
+        size_t to = end;
+        if (!f.re) to = (pool->total - end >= f.len - 1) ? end + f.len - 1 : pool->total;
+        size_t count = 0, cap = 0, at;
+        size_t *hits = NULL;
+        for (size_t from = start; from < end && doc_find(pool->ed, &f, from, to, &at); from = finder_resume(&f, at)) {
+            if (pool->hits) {
+                if (count == cap) {
+                    cap = cap ? cap * 2 : 1024;
+                    hits = realloc(hits, sizeof(size_t) * cap);
+                }
+                hits[count] = at;
+            }
+            count++;
+        }
+        pool->counts[r] = count;
+        if (pool->hits) pool->hits[r] = hits;
+    }
+    finder_free(&f);
+    return NULL;
+}
+
+/* Worker threads for whole-document scans - one per online CPU */
+int search_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > SEARCH_MAX_THREADS) n = SEARCH_MAX_THREADS;
+    return (int)n;
+}
+
+/*
+ * Count every match in the document, splitting it into byte ranges that
+ * up to threads workers scan at once.  Unless hits is NULL, *hits gets
+ * the match offsets in document order (caller frees).
+ */
+size_t doc_find_all(Editor *ed, Finder *f, size_t **hits, int threads) {
+    if (hits) *hits = NULL;
+    SearchPool pool;
+    pool.ed = ed;
+    pool.finder = f;
+    pool.total = doc_length(ed);
+    if (pool.total == 0 || (!f->re && f->len == 0) || f->len > pool.total) return 0;
+    
+    /* Pick the prefilter bytes once so every worker agrees */
+    if (!f->tuned && f->len > 0) {
+        size_t piece_offset;
+        PieceNode *node = piece_at(ed, 0, &piece_offset);
+        if (node) finder_tune(f, node->piece.buf->data + node->piece.start, node->piece.len);
+    }
+    
+    pool.num_ranges = (pool.total + SEARCH_RANGE_SIZE - 1) / SEARCH_RANGE_SIZE;
+    pool.next = 0;
+    pool.counts = calloc(pool.num_ranges, sizeof(size_t));
+    pool.hits = hits ? calloc(pool.num_ranges, sizeof(size_t*)) : NULL;
+    pthread_mutex_init(&pool.lock, NULL);
+    
+    if (threads > SEARCH_MAX_THREADS) threads = SEARCH_MAX_THREADS;
+    if ((size_t)threads > pool.num_ranges) threads = pool.num_ranges;
+    pthread_t workers[SEARCH_MAX_THREADS];
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, search_worker, &pool) == 0) {
+        started++;
+    }
+    search_worker(&pool);  /* This thread takes ranges too */
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    
+    /* Ranges are in document order - concatenating them keeps it */
+    size_t count = 0;
+    for (size_t r = 0; r < pool.num_ranges; r++) {
+        count += pool.counts[r];
+    }
+    if (hits) {
+        *hits = malloc(sizeof(size_t) * (count ? count : 1));
+        size_t n = 0;
+        for (size_t r = 0; r < pool.num_ranges; r++) {
+            if (pool.counts[r]) memcpy(*hits + n, pool.hits[r], sizeof(size_t) * pool.counts[r]);
+            n += pool.counts[r];
+            free(pool.hits[r]);
+        }
+        free(pool.hits);
+    }
+    free(pool.counts);
+    debug_log("doc_find_all: %zu matches, %zu ranges, %d threads", count, pool.num_ranges, started + 1);
+    return count;
+}
+
+/*
+ * Piece table
+ *
+ * The document is the original file contents plus an append-only add
+ * buffer.  A treap of piece descriptors, ordered by document position and
+ * annotated with subtree byte counts, stitches spans of both buffers
+ * together.  Edits split the tree at byte offsets and merge it back, so
+ * they cost O(log pieces) and never move existing text.  Lines are joined
+ * by '\n' (a '\r' right before it counts as part of the terminator); the
+ * terminator after the last line is not part of the document.
+ *
+ * Every buffer keeps a sorted array of its newline offsets and every node
+ * a subtree newline count, so line y resolves by descending the tree to
+ * the piece holding the y-th newline and indexing that buffer's array -
+ * O(log pieces) instead of walking the document.
+ */
+
+/*
+ * Offsets are kept as 32 bits - half the memory and cache lines of full
+ * ones, which matters for files of short lines - and the rare buffer past
+ * 4 GB notes where each further 4 GB starts in the array.
+ */
+static inline size_t newline_at(const TextBuf *buf, size_t i) {
+    if (buf->num_high == 0) return buf->newlines[i];
+    size_t high = 0;
+    while (high < buf->num_high && buf->newlines_high[high] <= i) high++;
+    return (high << 32) | buf->newlines[i];
+}
+
+/* Append one newline offset to the buffer index, counting CRLF pairs on the way */
+static inline void record_newline(TextBuf *buf, size_t pos) {
+    if (buf->num_newlines == buf->newlines_cap) {
+        buf->newlines_cap = buf->newlines_cap ? buf->newlines_cap * 2 : 64;
+        buf->newlines = realloc(buf->newlines, sizeof(uint32_t) * buf->newlines_cap);
+    }
+    while ((pos >> 32) > buf->num_high) {
+        buf->newlines_high = realloc(buf->newlines_high, sizeof(size_t) * (buf->num_high + 1));
+        buf->newlines_high[buf->num_high++] = buf->num_newlines;
+    }
+    buf->newlines[buf->num_newlines++] = (uint32_t)pos;
+    if (pos > 0 && buf->data[pos - 1] == '\r') buf->num_crlf++;
+}
+
+/*
+ * Record newlines in buf->data[from, to).  Lines have no length limit;
+ * the scan tests 64 bytes per step with SSE2 and only walks the bit mask
+ * of blocks that contain a newline, so dense short lines avoid a memchr
+ * call per line and long lines run at memory bandwidth.
+ */
+static void index_newlines(TextBuf *buf, size_t from, size_t to) {
+    const char *data = buf->data;
+    size_t pos = from;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (to - pos >= 64) {
+        const __m128i *block = (const __m128i *)(data + pos);
+        unsigned m0 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block), nl));
+        unsigned m1 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 1), nl));
+        unsigned m2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 2), nl));
+        unsigned m3 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 3), nl));
+        unsigned long long mask = m0 | ((unsigned long long)m1 << 16) |
+                                  ((unsigned long long)m2 << 32) | ((unsigned long long)m3 << 48);
+        while (mask) {
+            record_newline(buf, pos + __builtin_ctzll(mask));
+            mask &= mask - 1;
+        }
+        pos += 64;
+    }
+#endif
+    const char *p = data + pos;
+    const char *end = data + to;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        record_newline(buf, p - data);
+        p++;
+    }
+}
+
+/* Number of newlines in buf before offset pos */
+static size_t newline_rank(const TextBuf *buf, size_t pos) {
+    /* Only the newlines of pos's 4 GB compare by their low bits */
+    size_t high = pos >> 32;
+    if (high > buf->num_high) return buf->num_newlines;
+    size_t lo = high ? buf->newlines_high[high - 1] : 0;
+    size_t hi = (high < buf->num_high) ? buf->newlines_high[high] : buf->num_newlines;
+    uint32_t low = (uint32_t)pos;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (buf->newlines[mid] < low) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static unsigned int piece_rand(void) {
+    static unsigned int state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/*
+ * Piece nodes come from slabs rather than one malloc each: a tree of
+ * millions of pieces costs a few thousand allocations, and a whole
+ * document is dropped by freeing its slabs.  Only the main thread
+ * builds and frees trees.
+ */
+static PieceSlab *piece_slabs;
+static PieceNode *piece_free_list;  /* Freed nodes, linked through right */
+
+static PieceNode* piece_alloc(void) {
+    PieceNode *node = piece_free_list;
+    if (node) {
+        piece_free_list = node->right;
+    } else {
+        if (!piece_slabs || piece_slabs->used == PIECE_SLAB_NODES) {
+            PieceSlab *slab = malloc(sizeof(PieceSlab));
+            slab->next = piece_slabs;
+            slab->used = 0;
+            piece_slabs = slab;
+        }
+        node = &piece_slabs->nodes[piece_slabs->used++];
+    }
+    memset(node, 0, sizeof(PieceNode));
+    return node;
+}
+
+/* Drop every piece node at once - no tree may be in use */
+static void piece_pool_reset(void) {
+    while (piece_slabs) {
+        PieceSlab *next = piece_slabs->next;
+        free(piece_slabs);
+        piece_slabs = next;
+    }
+    piece_free_list = NULL;
+}
+
+static PieceNode* piece_node_new(TextBuf *buf, size_t start, size_t len) {
+    PieceNode *node = piece_alloc();
+    node->piece.buf = buf;
+    node->piece.start = start;
+    node->piece.len = len;
+    node->piece.first_nl = newline_rank(buf, start);
+    node->piece.lf = newline_rank(buf, start + len) - node->piece.first_nl;
+    node->priority = piece_rand();
+    node->total_len = len;
+    node->total_lf = node->piece.lf;
+    return node;
+}
+
+static void piece_update(PieceNode *node) {
+    node->total_len = node->piece.len;
+    node->total_lf = node->piece.lf;
+    if (node->left) {
+        node->total_len += node->left->total_len;
+        node->total_lf += node->left->total_lf;
+    }
+    if (node->right) {
+        node->total_len += node->right->total_len;
+        node->total_lf += node->right->total_lf;
+    }
+}
+
+/* Split tree into [0, offset) and [offset, end), cutting a piece if needed */
+static void piece_split(PieceNode *node, size_t offset, PieceNode **left, PieceNode **right) {
+    if (!node) {
+        *left = *right = NULL;
+        return;
+    }
+    
+    size_t left_len = node->left ? node->left->total_len : 0;
+    if (offset <= left_len) {
+        piece_split(node->left, offset, left, &node->left);
+        piece_update(node);
+        *right = node;
+    } else if (offset >= left_len + node->piece.len) {
+        piece_split(node->right, offset - left_len - node->piece.len, &node->right, right);
+        piece_update(node);
+        *left = node;
+    } else {
+        /* Offset falls inside this piece - cut it in two */
+        size_t cut = offset - left_len;
+        PieceNode *tail = piece_node_new(node->piece.buf, node->piece.start + cut,
+                                         node->piece.len - cut);
+        tail->priority = node->priority;
+        tail->right = node->right;
+        node->right = NULL;
+        node->piece.len = cut;
+        node->piece.lf -= tail->piece.lf;
+        piece_update(tail);
+        piece_update(node);
+        *left = node;
+        *right = tail;
+    }
+}
+
+/* Concatenate two trees (every offset in a precedes every offset in b) */
+static PieceNode* piece_merge(PieceNode *a, PieceNode *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->priority > b->priority) {
+        a->right = piece_merge(a->right, b);
+        piece_update(a);
+        return a;
+    }
+    b->left = piece_merge(a, b->left);
+    piece_update(b);
+    return b;
+}
+
+/* Free a piece tree - its nodes go back on the free list */
+void free_pieces(PieceNode *node) {
+    while (node) {
+        free_pieces(node->left);
+        PieceNode *right = node->right;
+        node->right = piece_free_list;
+        piece_free_list = node;
+        node = right;
+    }
+}
+
+/* Append one piece to a growing array */
+static void piece_push(Piece **out, size_t *count, size_t *cap, Piece piece) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        *out = realloc(*out, sizeof(Piece) * *cap);
+    }
+    (*out)[(*count)++] = piece;
+}
+
+/* Append subtree pieces in document order */
+static void piece_collect(PieceNode *node, Piece **out, size_t *count, size_t *cap) {
+    while (node) {
+        piece_collect(node->left, out, count, cap);
+        piece_push(out, count, cap, node->piece);
+        node = node->right;
+    }
+}
+
+/*
+ * Trees are built in one pass: each node goes on the right spine, taking
+ * the nodes of lower priority it displaces as its left subtree, which are
+ * complete by then.
+ */
+static void piece_builder_add(PieceBuilder *b, const Piece *piece) {
+    PieceNode *node = piece_alloc();
+    node->piece = *piece;
+    node->priority = piece_rand();
+    PieceNode *last = NULL;
+    while (b->depth > 0 && b->spine[b->depth - 1]->priority < node->priority) {
+        last = b->spine[--b->depth];
+        piece_update(last);
+    }
+    node->left = last;
+    if (b->depth > 0) b->spine[b->depth - 1]->right = node;
+    if (b->depth == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 64;
+        b->spine = realloc(b->spine, sizeof(PieceNode*) * b->cap);
+    }
+    b->spine[b->depth++] = node;
+}
+
+static PieceNode* piece_builder_finish(PieceBuilder *b) {
+    PieceNode *root = NULL;
+    while (b->depth > 0) {
+        root = b->spine[--b->depth];
+        piece_update(root);
+    }
+    free(b->spine);
+    memset(b, 0, sizeof(PieceBuilder));
+    return root;
+}
+
+/* Tree of count pieces in document order */
+static PieceNode* piece_build(const Piece *pieces, size_t count) {
+    PieceBuilder b = {0};
+    for (size_t i = 0; i < count; i++) {
+        piece_builder_add(&b, &pieces[i]);
+    }
+    return piece_builder_finish(&b);
+}
+
+/* Grow the rightmost piece of a tree by len bytes holding lf newlines */
+static void piece_extend_last(PieceNode *root, size_t len, size_t lf) {
+    for (PieceNode *node = root; node; node = node->right) {
+        node->total_len += len;
+        node->total_lf += lf;
+        if (!node->right) {
+            node->piece.len += len;
+            node->piece.lf += lf;
+        }
+    }
+}
+
+/* Append a span of buf to the end of the document, extending the last piece if contiguous */
+static void piece_append(Editor *ed, TextBuf *buf, size_t start, size_t len) {
+    PieceNode *last = ed->pieces;
+    while (last && last->right) last = last->right;
+    if (last && last->piece.buf == buf && last->piece.start + last->piece.len == start) {
+        piece_extend_last(ed->pieces, len, newline_rank(buf, start + len) - newline_rank(buf, start));
+    } else {
+        ed->pieces = piece_merge(ed->pieces, piece_node_new(buf, start, len));
+    }
+}
+
+/* Append text to the add buffer, starting a new chunk when the current one is full */
+static TextBuf* add_buffer_append(Editor *ed, const char *text, size_t len, size_t *start) {
+    TextBuf *add = ed->add;
+    if (!add || add->capacity - add->len < len) {
+        add = calloc(1, sizeof(TextBuf));
+        add->capacity = len > ADD_CHUNK_SIZE ? len : ADD_CHUNK_SIZE;
+        add->data = malloc(add->capacity);
+        add->next = ed->add;
+        ed->add = add;
+    }
+    *start = add->len;
+    memcpy(add->data + add->len, text, len);
+    add->len += len;
+    index_newlines(add, *start, add->len);
+    return add;
+}
+
+/* Document length in bytes */
+size_t doc_length(Editor *ed) {
+    return ed->pieces ? ed->pieces->total_len : 0;
+}
+
+/* Find the piece containing offset; piece_offset receives its document offset */
+PieceNode* piece_at(Editor *ed, size_t offset, size_t *piece_offset) {
+    PieceNode *node = ed->pieces;
+    size_t base = 0;
+    while (node) {
+        size_t left_len = node->left ? node->left->total_len : 0;
+        if (offset < left_len) {
+            node = node->left;
+        } else if (offset < left_len + node->piece.len) {
+            *piece_offset = base + left_len;
+            return node;
+        } else {
+            offset -= left_len + node->piece.len;
+            base += left_len + node->piece.len;
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+/* Copy len bytes starting at offset into dst */
+void doc_read(Editor *ed, size_t offset, size_t len, char *dst) {
+    while (len > 0) {
+        size_t piece_offset;
+        PieceNode *node = piece_at(ed, offset, &piece_offset);
+        if (!node) break;
+        size_t skip = offset - piece_offset;
+        size_t n = node->piece.len - skip;
+        if (n > len) n = len;
+        memcpy(dst, node->piece.buf->data + node->piece.start + skip, n);
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+/* Line number holding byte offset */
+int line_at_offset(Editor *ed, size_t offset) {
+    size_t lf = 0;
+    PieceNode *node = ed->pieces;
+    while (node) {
+        size_t left_len = node->left ? node->left->total_len : 0;
+        if (offset < left_len) {
+            node = node->left;
+            continue;
+        }
+        lf += node->left ? node->left->total_lf : 0;
+        offset -= left_len;
+        if (offset <= node->piece.len && (offset < node->piece.len || !node->right)) {
+            lf += newline_rank(node->piece.buf, node->piece.start + offset) - node->piece.first_nl;
+            break;
+        }
+        lf += node->piece.lf;
+        offset -= node->piece.len;
+        node = node->right;
+    }
+    return lf;
+}
+
+/* Fenwick tree: add delta to entry i (0-based) of n */
+static void fenwick_add(int *tree, int n, int i, int delta) {
+    for (i++; i <= n; i += i & -i) {
+        tree[i] += delta;
+    }
+}
+
+/* Fenwick tree: sum of entries [0, i) */
+static int fenwick_sum(const int *tree, int i) {
+    int sum = 0;
+    for (; i > 0; i -= i & -i) {
+        sum += tree[i];
+    }
+    return sum;
+}
+
+/* Fenwick tree: entry holding unit target, i.e. the count of entries whose running sum is <= target */
+static int fenwick_find(const int *tree, int n, int target) {
+    int pos = 0, step = 1;
+    while (step * 2 <= n) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= n && tree[pos + step] <= target) {
+            pos += step;
+            target -= tree[pos];
+        }
+    }
+    return pos;
+}
+
+/* Insert count fresh dirty blocks before block index at */
+static void syntax_insert_blocks(SyntaxIndex *si, int at, int count) {
+    if (si->num_blocks + count > si->blocks_cap) {
+        si->blocks_cap = (si->num_blocks + count) * 2;
+        si->blocks = realloc(si->blocks, sizeof(SyntaxBlock) * si->blocks_cap);
+    }
+    memmove(&si->blocks[at + count], &si->blocks[at], sizeof(SyntaxBlock) * (si->num_blocks - at));
+    memset(&si->blocks[at], 0, sizeof(SyntaxBlock) * count);
+    for (int i = at; i < at + count; i++) {
+        si->blocks[i].dirty = 1;
+    }
+    si->num_blocks += count;
+    si->stale = 1;
+}
+
+/* Build the line tree from the block counts */
+static void syntax_build_tree(SyntaxIndex *si) {
+    int n = si->num_blocks;
+    si->tree_lines = realloc(si->tree_lines, sizeof(int) * (n + 1));
+    si->tree_lines[0] = 0;
+    for (int i = 1; i <= n; i++) {
+        si->tree_lines[i] = si->blocks[i - 1].lines;
+    }
+    for (int i = 1; i <= n; i++) {
+        int parent = i + (i & -i);
+        if (parent <= n) si->tree_lines[parent] += si->tree_lines[i];
+    }
+    si->stale = 0;
+}
+
+/* Change the line count of block b */
+static void syntax_add_lines(SyntaxIndex *si, int b, int delta) {
+    si->blocks[b].lines += delta;
+    if (!si->stale) fenwick_add(si->tree_lines, si->num_blocks, b, delta);
+}
+
+/*
+ * Keep checkpoints in step with a line edit: the edited line's block is
+ * marked dirty, and lines merged into it are taken from the blocks that
+ * held them.  The block is found through the line tree, so replaying a
+ * long queue of edits costs a logarithm each, not a walk from the top.
+ */
+static void syntax_apply_edit(SyntaxIndex *si, const SyntaxEdit *edit) {
+    if (si->num_blocks == 0) return;
+    if (si->stale) syntax_build_tree(si);
+    
+    int y = edit->y;
+    int removed = edit->removed;
+    int b = fenwick_find(si->tree_lines, si->num_blocks, y);
+    if (b >= si->num_blocks) b = si->num_blocks - 1;
+    int start = fenwick_sum(si->tree_lines, b);
+    si->blocks[b].dirty = 1;
+    
+    /* Removed lines come first from this block, then from the ones after it */
+    int take = start + si->blocks[b].lines - 1 - y;
+    if (take > removed) take = removed;
+    syntax_add_lines(si, b, -take);
+    removed -= take;
+    for (int next = b + 1; removed > 0 && next < si->num_blocks; next++) {
+        take = si->blocks[next].lines < removed ? si->blocks[next].lines : removed;
+        si->blocks[next].dirty = 1;
+        syntax_add_lines(si, next, -take);
+        removed -= take;
+    }
+    syntax_add_lines(si, b, edit->added);
+    
+    /*
+     * Drop emptied blocks and split the one that grew too long, so one
+     * keystroke never rescans a huge run - in a single pass, since an edit
+     * spanning many lines empties many blocks.
+     */
+    int reshape = 0;
+    for (int i = b; i < si->num_blocks && (i == b || si->blocks[i].lines == 0); i++) {
+        if (si->blocks[i].lines == 0 || si->blocks[i].lines > 2 * SYNTAX_BLOCK_LINES) reshape = 1;
+    }
+    if (!reshape) return;
+    
+    int out = b + 1, end = b + 1;
+    while (end < si->num_blocks && si->blocks[end].lines == 0) end++;
+    memmove(&si->blocks[out], &si->blocks[end], sizeof(SyntaxBlock) * (si->num_blocks - end));
+    si->num_blocks -= end - out;
+    if (si->blocks[b].lines == 0) {
+        memmove(&si->blocks[b], &si->blocks[b + 1], sizeof(SyntaxBlock) * (si->num_blocks - b - 1));
+        si->num_blocks--;
+    } else if (si->blocks[b].lines > 2 * SYNTAX_BLOCK_LINES) {
+        int lines = si->blocks[b].lines;
+        int count = (lines + SYNTAX_BLOCK_LINES - 1) / SYNTAX_BLOCK_LINES;
+        syntax_insert_blocks(si, b + 1, count - 1);
+        for (int i = 0; i < count; i++) {
+            si->blocks[b + i].dirty = 1;
+            si->blocks[b + i].lines = (i < count - 1) ? SYNTAX_BLOCK_LINES : lines - SYNTAX_BLOCK_LINES * (count - 1);
+        }
+    }
+    si->stale = 1;
+}
+
+/* Queue a line change for the checkpoints */
+static void syntax_note_edit(Editor *ed, int y, int removed, int added) {
+    SyntaxIndex *si = &ed->syntax;
+    if (!si->tracking) return;
+    
+    if (si->num_edits == si->edits_cap) {
+        si->edits_cap = si->edits_cap ? si->edits_cap * 2 : 64;
+        si->edits = realloc(si->edits, sizeof(SyntaxEdit) * si->edits_cap);
+    }
+    SyntaxEdit *edit = &si->edits[si->num_edits++];
+    edit->y = y;
+    edit->removed = removed;
+    edit->added = added;
+}
+
+/* Build both trees from the block counts */
+static void wrap_build_trees(WrapIndex *wi) {
+    int n = wi->num_blocks;
+    wi->tree_lines = realloc(wi->tree_lines, sizeof(int) * (n + 1));
+    wi->tree_rows = realloc(wi->tree_rows, sizeof(int) * (n + 1));
+    wi->tree_lines[0] = wi->tree_rows[0] = 0;
+    for (int i = 1; i <= n; i++) {
+        wi->tree_lines[i] = wi->blocks[i - 1].lines;
+        wi->tree_rows[i] = wi->blocks[i - 1].lines + wi->blocks[i - 1].extra;
+    }
+    for (int i = 1; i <= n; i++) {
+        int parent = i + (i & -i);
+        if (parent <= n) {
+            wi->tree_lines[parent] += wi->tree_lines[i];
+            wi->tree_rows[parent] += wi->tree_rows[i];
+        }
+    }
+    wi->stale = 0;
+}
+
+/* Record a line of len bytes at index i of a block */
+static void wrap_add_line(WrapBlock *blk, int i, size_t len, int width) {
+    size_t rows = (len + width - 1) / width;
+    if (rows <= 1) return;
+    if (blk->num_wide + 2 > blk->wide_cap) {
+        blk->wide_cap = blk->wide_cap ? blk->wide_cap * 2 : 8;
+        blk->wide = realloc(blk->wide, sizeof(int) * blk->wide_cap);
+    }
+    int extra = rows - 1 > INT_MAX / 2 ? INT_MAX / 2 : (int)(rows - 1);
+    blk->wide[blk->num_wide++] = i;
+    blk->wide[blk->num_wide++] = extra;
+    blk->extra += extra;
+}
+
+/* Count the rows of a block starting at line y0 */
+static void wrap_count_block(Editor *ed, WrapBlock *blk, int y0) {
+    blk->extra = 0;
+    blk->num_wide = 0;
+    for (int i = 0; i < blk->lines; i++) {
+        wrap_add_line(blk, i, line_length(ed, y0 + i), ed->wrap.width);
+    }
+}
+
+/* Count every line from the piece list - one pass over the newline indexes */
+static void wrap_rebuild(Editor *ed) {
+    WrapIndex *wi = &ed->wrap;
+    int count = (ed->total_lines + WRAP_BLOCK_LINES - 1) / WRAP_BLOCK_LINES;
+    if (count > wi->blocks_cap) {
+        wi->blocks = realloc(wi->blocks, sizeof(WrapBlock) * count);
+        memset(wi->blocks + wi->blocks_cap, 0, sizeof(WrapBlock) * (count - wi->blocks_cap));
+        wi->blocks_cap = count;
+    }
+    for (int i = 0; i < count; i++) {
+        wi->blocks[i].lines = (i < count - 1) ? WRAP_BLOCK_LINES : ed->total_lines - WRAP_BLOCK_LINES * (count - 1);
+        wi->blocks[i].extra = 0;
+        wi->blocks[i].num_wide = 0;
+    }
+    wi->num_blocks = count;
+    wi->width = ed->edit_width;
+    
+    Piece *pieces = NULL;
+    size_t num_pieces = 0, cap = 0;
+    piece_collect(ed->pieces, &pieces, &num_pieces, &cap);
+    int y = 0;
+    size_t len = 0;     /* Bytes of line y seen so far */
+    char last = 0;      /* Last byte of line y seen so far */
+    for (size_t p = 0; p < num_pieces; p++) {
+        const Piece *piece = &pieces[p];
+        const char *data = piece->buf->data + piece->start;
+        size_t pos = 0;
+        for (size_t k = 0; k < piece->lf; k++) {
+            size_t nl = newline_at(piece->buf, piece->first_nl + k) - piece->start;
+            if (nl > pos) last = data[nl - 1];
+            len += nl - pos;
+            if (len > 0 && last == '\r') len--;  /* '\r' before the newline is part of it */
+            wrap_add_line(&wi->blocks[y / WRAP_BLOCK_LINES], y % WRAP_BLOCK_LINES, len, wi->width);
+            y++;
+            len = 0;
+            pos = nl + 1;
+        }
+        if (piece->len > pos) last = data[piece->len - 1];
+        len += piece->len - pos;
+    }
+    wrap_add_line(&wi->blocks[y / WRAP_BLOCK_LINES], y % WRAP_BLOCK_LINES, len, wi->width);
+    free(pieces);
+    
+    wi->num_dirty = 0;
+    wrap_build_trees(wi);
+}
+
+/* Bring the index up to date with the document and the wrap width */
+static void wrap_refresh(Editor *ed) {
+    WrapIndex *wi = &ed->wrap;
+    if (wi->width != ed->edit_width || wi->num_blocks == 0) {
+        wrap_rebuild(ed);
+        return;
+    }
+    if (wi->stale) {
+        int y0 = 0;
+        for (int b = 0; b < wi->num_blocks; b++) {
+            if (wi->blocks[b].extra < 0) wrap_count_block(ed, &wi->blocks[b], y0);
+            y0 += wi->blocks[b].lines;
+        }
+        wi->num_dirty = 0;
+        wrap_build_trees(wi);
+        return;
+    }
+    for (int i = 0; i < wi->num_dirty; i++) {
+        int b = wi->dirty[i];
+        if (wi->blocks[b].extra >= 0) continue;
+        wrap_count_block(ed, &wi->blocks[b], fenwick_sum(wi->tree_lines, b));
+        fenwick_add(wi->tree_rows, wi->num_blocks, b, wi->blocks[b].extra);
+    }
+    wi->num_dirty = 0;
+}
+
+/* Block b changed - drop its row count until the next refresh */
+static void wrap_mark_dirty(WrapIndex *wi, int b) {
+    if (wi->blocks[b].extra < 0) return;
+    if (!wi->stale) {
+        fenwick_add(wi->tree_rows, wi->num_blocks, b, -wi->blocks[b].extra);
+        if (wi->num_dirty == wi->dirty_cap) {
+            wi->dirty_cap = wi->dirty_cap ? wi->dirty_cap * 2 : 16;
+            wi->dirty = realloc(wi->dirty, sizeof(int) * wi->dirty_cap);
+        }
+        wi->dirty[wi->num_dirty++] = b;
+    }
+    wi->blocks[b].extra = -1;
+}
+
+/* Change the line count of block b */
+static void wrap_add_lines(WrapIndex *wi, int b, int delta) {
+    wi->blocks[b].lines += delta;
+    if (!wi->stale) {
+        fenwick_add(wi->tree_lines, wi->num_blocks, b, delta);
+        fenwick_add(wi->tree_rows, wi->num_blocks, b, delta);
+    }
+}
+
+/* Keep the row index in step with a line edit: line y absorbed removed lines, then gained added */
+static void wrap_note_edit(Editor *ed, int y, int removed, int added) {
+    WrapIndex *wi = &ed->wrap;
+    if (wi->width == 0 || wi->num_blocks == 0) return;
+    
+    int b = 0, start = 0;
+    if (wi->stale) {
+        while (b < wi->num_blocks - 1 && start + wi->blocks[b].lines <= y) {
+            start += wi->blocks[b].lines;
+            b++;
+        }
+    } else {
+        b = fenwick_find(wi->tree_lines, wi->num_blocks, y);
+        if (b >= wi->num_blocks) b = wi->num_blocks - 1;
+        start = fenwick_sum(wi->tree_lines, b);
+    }
+    wrap_mark_dirty(wi, b);
+    
+    /* Removed lines come first from this block, then from the ones after it */
+    int take = start + wi->blocks[b].lines - 1 - y;
+    if (take > removed) take = removed;
+    wrap_add_lines(wi, b, -take);
+    removed -= take;
+    for (int next = b + 1; removed > 0 && next < wi->num_blocks; next++) {
+        take = wi->blocks[next].lines < removed ? wi->blocks[next].lines : removed;
+        wrap_mark_dirty(wi, next);
+        wrap_add_lines(wi, next, -take);
+        removed -= take;
+    }
+    wrap_add_lines(wi, b, added);
+    
+    /* Drop emptied blocks and split long ones - the trees are rebuilt on the next lookup */
+    int reshape = 0;
+    for (int i = b; i < wi->num_blocks && (i == b || wi->blocks[i].lines == 0); i++) {
+        if (wi->blocks[i].lines == 0 || wi->blocks[i].lines > 2 * WRAP_BLOCK_LINES) reshape = 1;
+    }
+    if (!reshape) return;
+    
+    int count = 0;
+    for (int i = 0; i < wi->num_blocks; i++) {
+        int lines = wi->blocks[i].lines;
+        if (lines > 0) count += lines > 2 * WRAP_BLOCK_LINES ? (lines + WRAP_BLOCK_LINES - 1) / WRAP_BLOCK_LINES : 1;
+    }
+    WrapBlock *blocks = calloc(count > 0 ? count : 1, sizeof(WrapBlock));
+    int out = 0;
+    for (int i = 0; i < wi->blocks_cap; i++) {
+        WrapBlock *blk = &wi->blocks[i];
+        if (i >= wi->num_blocks || blk->lines == 0) {
+            free(blk->wide);
+        } else if (blk->lines > 2 * WRAP_BLOCK_LINES) {
+            int pieces = (blk->lines + WRAP_BLOCK_LINES - 1) / WRAP_BLOCK_LINES;
+            for (int k = 0; k < pieces; k++) {
+                blocks[out].lines = (k < pieces - 1) ? WRAP_BLOCK_LINES : blk->lines - WRAP_BLOCK_LINES * (pieces - 1);
+                blocks[out].extra = -1;
+                out++;
+            }
+            free(blk->wide);
+        } else {
+            blocks[out++] = *blk;
+        }
+    }
+    free(wi->blocks);
+    wi->blocks = blocks;
+    wi->num_blocks = out;
+    wi->blocks_cap = count > 0 ? count : 1;
+    wi->stale = 1;
+}
+
+/* Count the lines load_more() appended: orig newlines from first_nl on, text ending at to */
+static void wrap_note_load(Editor *ed, size_t first_nl, size_t to) {
+    WrapIndex *wi = &ed->wrap;
+    if (wi->width == 0 || wi->num_blocks == 0) return;
+    
+    TextBuf *orig = &ed->orig;
+    wrap_mark_dirty(wi, wi->num_blocks - 1);  /* The old last line may have grown */
+    for (size_t k = first_nl; k < orig->num_newlines; k++) {
+        size_t start = newline_at(orig, k) + 1;
+        size_t end = (k + 1 < orig->num_newlines) ? newline_at(orig, k + 1) : to;
+        size_t len = end - start;
+        if (k + 1 < orig->num_newlines && len > 0 && orig->data[end - 1] == '\r') len--;
+        
+        WrapBlock *blk = &wi->blocks[wi->num_blocks - 1];
+        if (blk->lines >= WRAP_BLOCK_LINES) {
+            if (wi->num_blocks == wi->blocks_cap) {
+                wi->blocks = realloc(wi->blocks, sizeof(WrapBlock) * wi->blocks_cap * 2);
+                memset(wi->blocks + wi->blocks_cap, 0, sizeof(WrapBlock) * wi->blocks_cap);
+                wi->blocks_cap *= 2;
+            }
+            blk = &wi->blocks[wi->num_blocks++];
+            blk->lines = 0;
+            blk->extra = 0;
+            blk->num_wide = 0;
+        }
+        if (blk->extra >= 0) wrap_add_line(blk, blk->lines, len, wi->width);
+        blk->lines++;
+    }
+    wi->stale = 1;
+}
+
+static void match_add_hit(MatchBlock *blk, size_t offset) {
+    if (blk->count == blk->hits_cap) {
+        blk->hits_cap = blk->hits_cap ? blk->hits_cap * 2 : 8;
+        blk->hits = realloc(blk->hits, sizeof(size_t) * blk->hits_cap);
+    }
+    blk->hits[blk->count++] = offset;
+}
+
+/* Rescan the matches of a block starting at line y0 */
+static void match_scan_block(Editor *ed, MatchBlock *blk, int y0) {
+    size_t base = line_offset(ed, y0);
+    size_t to = (y0 + blk->lines < ed->total_lines) ? line_offset(ed, y0 + blk->lines) : doc_length(ed);
+    size_t at;
+    blk->count = 0;
+    for (size_t from = base; blk->lines > 0 && doc_find(ed, &ed->matches.finder, from, to, &at); from = finder_resume(&ed->matches.finder, at)) {
+        match_add_hit(blk, at - base);
+    }
+}
+
+/* Build both trees from the block counts */
+static void match_build_trees(MatchIndex *mi) {
+    int n = mi->num_blocks;
+    mi->tree_lines = realloc(mi->tree_lines, sizeof(int) * (n + 1));
+    mi->tree_hits = realloc(mi->tree_hits, sizeof(int) * (n + 1));
+    mi->tree_lines[0] = mi->tree_hits[0] = 0;
+    for (int i = 1; i <= n; i++) {
+        mi->tree_lines[i] = mi->blocks[i - 1].lines;
+        mi->tree_hits[i] = mi->blocks[i - 1].count;
+    }
+    for (int i = 1; i <= n; i++) {
+        int parent = i + (i & -i);
+        if (parent <= n) {
+            mi->tree_lines[parent] += mi->tree_lines[i];
+            mi->tree_hits[parent] += mi->tree_hits[i];
+        }
+    }
+    mi->stale = 0;
+}
+
+/* Index every match of a new query - one pass over the document */
+static void match_build(Editor *ed) {
+    MatchIndex *mi = &ed->matches;
+    int count = (ed->total_lines + MATCH_BLOCK_LINES - 1) / MATCH_BLOCK_LINES;
+    if (count > mi->blocks_cap) {
+        mi->blocks = realloc(mi->blocks, sizeof(MatchBlock) * count);
+        memset(mi->blocks + mi->blocks_cap, 0, sizeof(MatchBlock) * (count - mi->blocks_cap));
+        mi->blocks_cap = count;
+    }
+    for (int i = 0; i < count; i++) {
+        mi->blocks[i].lines = (i < count - 1) ? MATCH_BLOCK_LINES : ed->total_lines - MATCH_BLOCK_LINES * (count - 1);
+        mi->blocks[i].count = 0;
+    }
+    mi->num_blocks = count;
+    
+    /* Only block starts need a line lookup - hits are kept as offsets */
+    size_t total = doc_length(ed);
+    size_t base = 0, next = (count > 1) ? line_offset(ed, MATCH_BLOCK_LINES) : total;
+    size_t *hits;
+    size_t num_hits = doc_find_all(ed, &mi->finder, &hits, search_threads());
+    int b = 0;
+    for (size_t i = 0; i < num_hits; i++) {
+        size_t at = hits[i];
+        while (b < count - 1 && at >= next) {
+            b++;
+            base = next;
+            next = (b < count - 1) ? line_offset(ed, (b + 1) * MATCH_BLOCK_LINES) : total;
+        }
+        match_add_hit(&mi->blocks[b], at - base);
+    }
+    free(hits);
+    mi->num_dirty = 0;
+    match_build_trees(mi);
+}
+
+/* Rescan the blocks edits touched */
+static void match_refresh(Editor *ed) {
+    MatchIndex *mi = &ed->matches;
+    if (mi->stale) {
+        int y0 = 0;
+        for (int b = 0; b < mi->num_blocks; b++) {
+            if (mi->blocks[b].count < 0) match_scan_block(ed, &mi->blocks[b], y0);
+            y0 += mi->blocks[b].lines;
+        }
+        mi->num_dirty = 0;
+        match_build_trees(mi);
+        return;
+    }
+    for (int i = 0; i < mi->num_dirty; i++) {
+        int b = mi->dirty[i];
+        if (mi->blocks[b].count >= 0) continue;
+        match_scan_block(ed, &mi->blocks[b], fenwick_sum(mi->tree_lines, b));
+        fenwick_add(mi->tree_hits, mi->num_blocks, b, mi->blocks[b].count);
+    }
+    mi->num_dirty = 0;
+}
+
+/* Block b changed - drop its matches until the next refresh */
+static void match_mark_dirty(MatchIndex *mi, int b) {
+    if (mi->blocks[b].count < 0) return;
+    if (!mi->stale) {
+        fenwick_add(mi->tree_hits, mi->num_blocks, b, -mi->blocks[b].count);
+        if (mi->num_dirty == mi->dirty_cap) {
+            mi->dirty_cap = mi->dirty_cap ? mi->dirty_cap * 2 : 16;
+            mi->dirty = realloc(mi->dirty, sizeof(int) * mi->dirty_cap);
+        }
+        mi->dirty[mi->num_dirty++] = b;
+    }
+    mi->blocks[b].count = -1;
+}
+
+/* Change the line count of block b */
+static void match_add_lines(MatchIndex *mi, int b, int delta) {
+    mi->blocks[b].lines += delta;
+    if (!mi->stale) fenwick_add(mi->tree_lines, mi->num_blocks, b, delta);
+}
+
+/* Keep the match index in step with a line edit: line y absorbed removed lines, then gained added */
+static void match_note_edit(Editor *ed, int y, int removed, int added) {
+    MatchIndex *mi = &ed->matches;
+    if (!mi->active || mi->num_blocks == 0) return;
+    
+    int b = 0, start = 0;
+    if (mi->stale) {
+        while (b < mi->num_blocks - 1 && start + mi->blocks[b].lines <= y) {
+            start += mi->blocks[b].lines;
+            b++;
+        }
+    } else {
+        b = fenwick_find(mi->tree_lines, mi->num_blocks, y);
+        if (b >= mi->num_blocks) b = mi->num_blocks - 1;
+        start = fenwick_sum(mi->tree_lines, b);
+    }
+    match_mark_dirty(mi, b);
+    
+    /* Removed lines come first from this block, then from the ones after it */
+    int take = start + mi->blocks[b].lines - 1 - y;
+    if (take > removed) take = removed;
+    match_add_lines(mi, b, -take);
+    removed -= take;
+    for (int next = b + 1; removed > 0 && next < mi->num_blocks; next++) {
+        take = mi->blocks[next].lines < removed ? mi->blocks[next].lines : removed;
+        match_mark_dirty(mi, next);
+        match_add_lines(mi, next, -take);
+        removed -= take;
+    }
+    match_add_lines(mi, b, added);
+    if (mi->blocks[b].lines <= 2 * MATCH_BLOCK_LINES) return;
+    
+    /* Split the grown block and drop emptied ones - the trees are rebuilt on the next lookup */
+    int count = 0;
+    for (int i = 0; i < mi->num_blocks; i++) {
+        int lines = mi->blocks[i].lines;
+        if (lines > 0) count += (i == b) ? (lines + MATCH_BLOCK_LINES - 1) / MATCH_BLOCK_LINES : 1;
+    }
+    MatchBlock *blocks = calloc(count, sizeof(MatchBlock));
+    int out = 0;
+    for (int i = 0; i < mi->blocks_cap; i++) {
+        MatchBlock *blk = &mi->blocks[i];
+        if (i == b) {
+            int pieces = (blk->lines + MATCH_BLOCK_LINES - 1) / MATCH_BLOCK_LINES;
+            for (int k = 0; k < pieces; k++) {
+                blocks[out].lines = (k < pieces - 1) ? MATCH_BLOCK_LINES : blk->lines - MATCH_BLOCK_LINES * (pieces - 1);
+                blocks[out].count = -1;
+                out++;
+            }
+            free(blk->hits);
+        } else if (i >= mi->num_blocks || blk->lines == 0) {
+            free(blk->hits);
+        } else {
+            blocks[out++] = *blk;
+        }
+    }
+    free(mi->blocks);
+    mi->blocks = blocks;
+    mi->num_blocks = out;
+    mi->blocks_cap = count;
+    mi->stale = 1;
+}
+
+/* Matches before column x of line y (or up to and including it) */
+static int match_rank(Editor *ed, int y, int x, int inclusive) {
+    MatchIndex *mi = &ed->matches;
+    int b = fenwick_find(mi->tree_lines, mi->num_blocks, y);
+    if (b >= mi->num_blocks) return fenwick_sum(mi->tree_hits, mi->num_blocks);
+    
+    const MatchBlock *blk = &mi->blocks[b];
+    size_t offset = line_offset(ed, y) + x - line_offset(ed, fenwick_sum(mi->tree_lines, b));
+    int lo = 0, hi = blk->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (blk->hits[mid] < offset || (inclusive && blk->hits[mid] == offset)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return fenwick_sum(mi->tree_hits, b) + lo;
+}
+
+/* Position of match k (0-based) */
+static void match_at(Editor *ed, int k, int *y, int *x) {
+    MatchIndex *mi = &ed->matches;
+    int b = fenwick_find(mi->tree_hits, mi->num_blocks, k);
+    int i = k - fenwick_sum(mi->tree_hits, b);
+    size_t offset = line_offset(ed, fenwick_sum(mi->tree_lines, b)) + mi->blocks[b].hits[i];
+    *y = line_at_offset(ed, offset);
+    *x = offset - line_offset(ed, *y);
+}
+
+/* Number of the match under the cursor (0 = none) and the total */
+int match_current(Editor *ed, int *total) {
+    MatchIndex *mi = &ed->matches;
+    *total = 0;
+    if (!mi->active) return 0;
+    match_refresh(ed);
+    *total = fenwick_sum(mi->tree_hits, mi->num_blocks);
+    
+    int k = match_rank(ed, ed->cursor_y, ed->cursor_x, 0);
+    if (k >= *total) return 0;
+    int y, x;
+    match_at(ed, k, &y, &x);
+    return (y == ed->cursor_y && x == ed->cursor_x) ? k + 1 : 0;
+}
+
+/* Index all matches of query for next/previous */
+int match_start(Editor *ed, const char *query, size_t len, int regex) {
+    MatchIndex *mi = &ed->matches;
+    if (mi->active) finder_free(&mi->finder);
+    const char *error;
+    if (regex) {
+        if (!finder_init_regex(&mi->finder, query, len, &error)) {
+            mi->active = 0;
+            return 0;
+        }
+    } else {
+        finder_init(&mi->finder, query, len);
+    }
+    mi->active = 1;
+    match_build(ed);
+    
+    int total = fenwick_sum(mi->tree_hits, mi->num_blocks);
+    if (total == 0) match_stop(ed);
+    return total;
+}
+
+void match_stop(Editor *ed) {
+    MatchIndex *mi = &ed->matches;
+    if (!mi->active) return;
+    finder_free(&mi->finder);
+    mi->active = 0;
+    mi->num_blocks = 0;
+    mi->num_dirty = 0;
+}
+
+/* Tell the line indexes about an edit: line y absorbed removed lines, then gained added */
+static int line_indexed(Editor *ed) {
+    return ed->syntax.tracking || ed->wrap.width != 0 || ed->matches.active;
+}
+
+static void note_lines(Editor *ed, int y, int removed, int added) {
+    syntax_note_edit(ed, y, removed, added);
+    wrap_note_edit(ed, y, removed, added);
+    match_note_edit(ed, y, removed, added);
+}
+
+/* The same for an edit at offset */
+static void note_line_edit(Editor *ed, size_t offset, int removed, int added) {
+    if (!line_indexed(ed)) return;
+    note_lines(ed, line_at_offset(ed, offset), removed, added);
+}
+
+/* Screen rows a line takes */
+int line_rows(Editor *ed, int y) {
+    size_t len = line_length(ed, y);
+    int rows = (len + ed->edit_width - 1) / ed->edit_width;
+    return rows < 1 ? 1 : rows;
+}
+
+/* Screen rows above line y when the document is drawn from its start */
+int visual_row(Editor *ed, int y) {
+    WrapIndex *wi = &ed->wrap;
+    wrap_refresh(ed);
+    if (y <= 0) return 0;
+    if (y >= ed->total_lines) return fenwick_sum(wi->tree_rows, wi->num_blocks);
+    
+    int b = fenwick_find(wi->tree_lines, wi->num_blocks, y);
+    int local = y - fenwick_sum(wi->tree_lines, b);
+    int row = fenwick_sum(wi->tree_rows, b) + local;
+    const WrapBlock *blk = &wi->blocks[b];
+    for (int i = 0; i < blk->num_wide && blk->wide[i] < local; i += 2) {
+        row += blk->wide[i + 1];
+    }
+    return row;
+}
+
+/* Line shown on visual row row; *wrap receives which of its rows that is */
+int visual_line_at(Editor *ed, int row, int *wrap) {
+    WrapIndex *wi = &ed->wrap;
+    wrap_refresh(ed);
+    *wrap = 0;
+    if (row <= 0) return 0;
+    int total = fenwick_sum(wi->tree_rows, wi->num_blocks);
+    if (row >= total) {
+        *wrap = line_rows(ed, ed->total_lines - 1) - 1;
+        return ed->total_lines - 1;
+    }
+    
+    int b = fenwick_find(wi->tree_rows, wi->num_blocks, row);
+    int local_row = row - fenwick_sum(wi->tree_rows, b);
+    int y0 = fenwick_sum(wi->tree_lines, b);
+    const WrapBlock *blk = &wi->blocks[b];
+    int line = 0, at = 0;  /* Row where local line 'line' starts */
+    for (int i = 0; i < blk->num_wide; i += 2) {
+        int wide_row = at + (blk->wide[i] - line);
+        if (local_row < wide_row) break;
+        if (local_row <= wide_row + blk->wide[i + 1]) {
+            *wrap = local_row - wide_row;
+            return y0 + blk->wide[i];
+        }
+        line = blk->wide[i] + 1;
+        at = wide_row + blk->wide[i + 1] + 1;
+    }
+    return y0 + line + (local_row - at);
+}
+
+/* Scroll so the cursor's row is on screen, by whole screen rows */
+void scroll_to_cursor(Editor *ed) {
+    int rows = line_rows(ed, ed->cursor_y);
+    int cursor_wrap = ed->cursor_x / ed->edit_width;
+    if (cursor_wrap > rows) cursor_wrap = rows;
+    if (ed->offset_wrap >= line_rows(ed, ed->offset_y)) ed->offset_wrap = 0;
+    
+    int top = visual_row(ed, ed->offset_y) + ed->offset_wrap;
+    int cursor = visual_row(ed, ed->cursor_y) + cursor_wrap;
+    if (cursor < top) {
+        ed->offset_y = ed->cursor_y;
+        ed->offset_wrap = cursor_wrap < rows ? cursor_wrap : rows - 1;
+    } else if (cursor - top >= ed->edit_height) {
+        ed->offset_y = visual_line_at(ed, cursor - ed->edit_height + 1, &ed->offset_wrap);
+    }
+}
+
+/* History step i, counted from the oldest */
+static UndoGroup* history_at(Editor *ed, int i) {
+    return &ed->history[(ed->history_start + i) % ed->history_cap];
+}
+
+/* Free the ops of an undo group */
+static void undo_group_free(Editor *ed, UndoGroup *group) {
+    for (size_t i = 0; i < group->num_ops; i++) {
+        free(group->ops[i].pieces);
+    }
+    free(group->ops);
+    ed->undo_bytes -= group->bytes;
+    memset(group, 0, sizeof(UndoGroup));
+}
+
+/* Drop the redo branch - any new edit invalidates it */
+static void history_drop_redo(Editor *ed) {
+    while (ed->redo_count > 0) {
+        ed->redo_count--;
+        undo_group_free(ed, history_at(ed, ed->undo_count + ed->redo_count));
+    }
+}
+
+/* Charge heap growth of a group against the history budget */
+static void undo_account(Editor *ed, UndoGroup *group, size_t bytes) {
+    group->bytes += bytes;
+    ed->undo_bytes += bytes;
+}
+
+/* Open the step save_undo() asked for, now that an edit is about to be logged */
+static void undo_open(Editor *ed) {
+    ed->undo_pending = 0;
+    history_drop_redo(ed);
+    
+    /* Evict the oldest steps once the history is over budget - O(1) each */
+    while (ed->undo_count > 0 && ed->undo_bytes > ed->undo_budget) {
+        undo_group_free(ed, history_at(ed, 0));
+        ed->history_start = (ed->history_start + 1) % ed->history_cap;
+        ed->undo_count--;
+    }
+    
+    /* Full ring - double it, unrolling the steps to the front */
+    if (ed->undo_count == ed->history_cap) {
+        int cap = ed->history_cap ? ed->history_cap * 2 : 64;
+        UndoGroup *history = calloc(cap, sizeof(UndoGroup));
+        for (int i = 0; i < ed->undo_count; i++) {
+            history[i] = *history_at(ed, i);
+        }
+        free(ed->history);
+        ed->history = history;
+        ed->history_cap = cap;
+        ed->history_start = 0;
+    }
+    
+    UndoGroup *group = history_at(ed, ed->undo_count);
+    memset(group, 0, sizeof(UndoGroup));
+    group->cursor_x = ed->undo_pending_x;
+    group->cursor_y = ed->undo_pending_y;
+    
+    ed->undo_count++;
+    debug_log("Undo saved: %d states, %zu bytes", ed->undo_count, ed->undo_bytes);
+}
+
+/* Next op slot in the open undo group, or NULL when edits are not being logged */
+static UndoOp* undo_log(Editor *ed) {
+    if (ed->undo_replaying) return NULL;
+    if (ed->undo_pending) undo_open(ed);
+    history_drop_redo(ed);
+    if (ed->undo_count == 0) return NULL;
+    UndoGroup *group = history_at(ed, ed->undo_count - 1);
+    if (group->num_ops == group->ops_cap) {
+        size_t cap = group->ops_cap ? group->ops_cap * 2 : 4;
+        group->ops = realloc(group->ops, sizeof(UndoOp) * cap);
+        undo_account(ed, group, sizeof(UndoOp) * (cap - group->ops_cap));
+        group->ops_cap = cap;
+    }
+    UndoOp *op = &group->ops[group->num_ops++];
+    memset(op, 0, sizeof(UndoOp));
+    return op;
+}
+
+/* Keep the removed spans of a logged op */
+static void undo_log_pieces(Editor *ed, UndoGroup *group, UndoOp *op, PieceNode *removed) {
+    size_t cap = 0;
+    piece_collect(removed, &op->pieces, &op->num_pieces, &cap);
+    undo_account(ed, group, sizeof(Piece) * cap);
+}
+
+/* Log an insert, folding it into the previous one when typing continues it */
+static void undo_log_insert(Editor *ed, size_t offset, size_t len) {
+    if (ed->undo_replaying) return;
+    if (ed->undo_pending) undo_open(ed);
+    history_drop_redo(ed);
+    if (ed->undo_count == 0) return;
+    UndoGroup *group = history_at(ed, ed->undo_count - 1);
+    if (group->num_ops > 0) {
+        UndoOp *last = &group->ops[group->num_ops - 1];
+        if (last->type == UNDO_INSERT && !last->pieces && last->offset + last->len == offset) {
+            last->len += len;
+            return;
+        }
+    }
+    UndoOp *op = undo_log(ed);
+    op->type = UNDO_INSERT;
+    op->offset = offset;
+    op->len = len;
+}
+
+/* Delete a logged insert during undo, keeping its spans for redo */
+static void doc_unlog_insert(Editor *ed, UndoGroup *group, UndoOp *op) {
+    PieceNode *left, *mid, *right;
+    piece_split(ed->pieces, op->offset, &left, &mid);
+    piece_split(mid, op->len, &mid, &right);
+    
+    if (!op->pieces) {
+        undo_log_pieces(ed, group, op, mid);
+    }
+    int removed = mid ? mid->total_lf : 0;
+    ed->total_lines -= removed;
+    free_pieces(mid);
+    ed->pieces = piece_merge(left, right);
+    ed->revision++;
+    note_line_edit(ed, op->offset, removed, 0);
+}
+
+/* Put previously deleted spans back at offset - no text is copied */
+static void doc_insert_pieces(Editor *ed, size_t offset, const Piece *pieces, size_t count) {
+    PieceNode *left, *right;
+    piece_split(ed->pieces, offset, &left, &right);
+    PieceNode *mid = piece_build(pieces, count);
+    int added = mid ? mid->total_lf : 0;
+    ed->total_lines += added;
+    ed->pieces = piece_merge(piece_merge(left, mid), right);
+    ed->revision++;
+    note_line_edit(ed, offset, 0, added);
+}
+
+/* Insert text at offset */
+void doc_insert(Editor *ed, size_t offset, const char *text, size_t len) {
+    if (len == 0) return;
+    undo_log_insert(ed, offset, len);
+    
+    size_t start;
+    TextBuf *add = add_buffer_append(ed, text, len, &start);
+    
+    PieceNode *left, *right;
+    piece_split(ed->pieces, offset, &left, &right);
+    
+    /* Typing continues the previous insert - grow that piece in place */
+    PieceNode *last = left;
+    while (last && last->right) last = last->right;
+    size_t lf = add->num_newlines - newline_rank(add, start);
+    /* Extending keeps first_nl valid: the new newlines are the next indices */
+    if (last && last->piece.buf == add && last->piece.start + last->piece.len == start) {
+        piece_extend_last(left, len, lf);
+    } else {
+        left = piece_merge(left, piece_node_new(add, start, len));
+    }
+    ed->pieces = piece_merge(left, right);
+    ed->total_lines += lf;
+    ed->revision++;
+    note_line_edit(ed, offset, 0, lf);
+}
+
+/* Delete len bytes starting at offset */
+void doc_delete(Editor *ed, size_t offset, size_t len) {
+    if (len == 0) return;
+    
+    PieceNode *left, *mid, *right;
+    piece_split(ed->pieces, offset, &left, &mid);
+    piece_split(mid, len, &mid, &right);
+    
+    UndoOp *op = undo_log(ed);
+    if (op) {
+        op->type = UNDO_DELETE;
+        op->offset = offset;
+        op->len = len;
+        undo_log_pieces(ed, history_at(ed, ed->undo_count - 1), op, mid);
+    }
+    
+    int removed = mid ? mid->total_lf : 0;
+    ed->total_lines -= removed;
+    free_pieces(mid);
+    ed->pieces = piece_merge(left, right);
+    ed->revision++;
+    note_line_edit(ed, offset, removed, 0);
+}
+
+/*
+ * Replace the len bytes at each of count ascending, non-overlapping
+ * offsets with text, in one pass over the pieces.  The text is stored once
+ * and every replacement is a piece pointing at it; the undo step gets a
+ * single op holding the pieces the document had before.
+ */
+void doc_replace_all(Editor *ed, const size_t *hits, size_t count, size_t len, const char *text, size_t text_len) {
+    if (count == 0) return;
+    Piece *old = NULL;
+    size_t num_old = 0, old_cap = 0;
+    piece_collect(ed->pieces, &old, &num_old, &old_cap);
+    PieceBuilder out = {0};
+    
+    Piece repl = {0};
+    if (text_len > 0) {
+        size_t start;
+        TextBuf *add = add_buffer_append(ed, text, text_len, &start);
+        repl.buf = add;
+        repl.start = start;
+        repl.len = text_len;
+        repl.first_nl = newline_rank(add, start);
+        repl.lf = newline_rank(add, start + text_len) - repl.first_nl;
+    }
+    
+    size_t total = doc_length(ed), pos = 0, skip = 0, p = 0;
+    size_t nl = old[0].first_nl;  /* Next newline of old[p] at or after skip */
+    int y = 0;             /* Newlines before pos in the new text */
+    int first = 0, last = 0, dropped = 0;  /* Lines of the first and last match, newlines inside matches */
+    for (size_t i = 0; i <= count; i++) {
+        /* Keep the text up to the match, then drop the match */
+        size_t keep = (i < count) ? hits[i] : total;
+        size_t drop = (i < count) ? hits[i] + len : total;
+        int removed = 0;
+        while (pos < drop) {
+            size_t until = pos < keep ? keep : drop;
+            size_t take = old[p].len - skip;
+            if (take > until - pos) take = until - pos;
+            /* Slices go in order, so their newlines are counted by walking the piece's */
+            Piece slice = { old[p].buf, old[p].start + skip, take, 0, nl };
+            size_t last_nl = old[p].first_nl + old[p].lf;
+            while (nl < last_nl && newline_at(slice.buf, nl) < slice.start + take) nl++;
+            slice.lf = nl - slice.first_nl;
+            if (pos < keep) {
+                piece_builder_add(&out, &slice);
+                y += slice.lf;
+            } else {
+                removed += slice.lf;
+            }
+            pos += take;
+            skip += take;
+            if (skip == old[p].len && ++p < num_old) {
+                skip = 0;
+                nl = old[p].first_nl;
+            }
+        }
+        if (i == count) break;
+        
+        if (repl.len > 0) piece_builder_add(&out, &repl);
+        if (i == 0) first = y;
+        dropped += removed;
+        y += repl.lf;
+        last = y;
+    }
+    
+    PieceNode *root = piece_builder_finish(&out);
+    ed->total_lines += (int)(root ? root->total_lf : 0) - (int)ed->pieces->total_lf;
+    free_pieces(ed->pieces);
+    ed->pieces = root;
+    ed->revision++;
+    /*
+     * One edit spanning the first to the last matched line - the line
+     * indexes rescan that run once instead of replaying a change per line.
+     */
+    if (line_indexed(ed)) {
+        int span = last - first;
+        note_lines(ed, first, span - (int)count * (int)repl.lf + dropped, span);
+    }
+    
+    UndoOp *op = undo_log(ed);
+    if (op) {
+        op->type = UNDO_REPLACE;
+        op->pieces = realloc(old, sizeof(Piece) * num_old);
+        op->num_pieces = num_old;
+        undo_account(ed, history_at(ed, ed->undo_count - 1), sizeof(Piece) * num_old);
+    } else {
+        free(old);
+    }
+}
+
+/* Undo or redo a replace-all: swap in the version the op holds, leaving the current one there */
+static void doc_swap_pieces(Editor *ed, UndoGroup *group, UndoOp *op) {
+    Piece *now = NULL;
+    size_t num_now = 0, cap = 0;
+    piece_collect(ed->pieces, &now, &num_now, &cap);
+    now = realloc(now, sizeof(Piece) * num_now);
+    
+    PieceNode *root = piece_build(op->pieces, op->num_pieces);
+    int removed = ed->pieces ? ed->pieces->total_lf : 0;
+    int added = root ? root->total_lf : 0;
+    free_pieces(ed->pieces);
+    ed->pieces = root;
+    ed->total_lines += added - removed;
+    ed->revision++;
+    if (line_indexed(ed)) note_lines(ed, 0, removed, added);
+    
+    group->bytes -= sizeof(Piece) * op->num_pieces;
+    ed->undo_bytes -= sizeof(Piece) * op->num_pieces;
+    free(op->pieces);
+    op->pieces = now;
+    op->num_pieces = num_now;
+    undo_account(ed, group, sizeof(Piece) * num_now);
+}
+
+/* Find the k-th newline (1-based); returns its piece, document offset and buffer index */
+static PieceNode* find_newline(Editor *ed, size_t k, size_t *offset, size_t *index) {
+    size_t base = 0;
+    PieceNode *node = ed->pieces;
+    while (node) {
+        size_t left_lf = node->left ? node->left->total_lf : 0;
+        size_t left_len = node->left ? node->left->total_len : 0;
+        if (k <= left_lf) {
+            node = node->left;
+        } else if (k <= left_lf + node->piece.lf) {
+            *index = node->piece.first_nl + (k - left_lf) - 1;
+            *offset = base + left_len + (newline_at(node->piece.buf, *index) - node->piece.start);
+            return node;
+        } else {
+            k -= left_lf + node->piece.lf;
+            base += left_len + node->piece.len;
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+/* Byte offset where line y starts */
+size_t line_offset(Editor *ed, int y) {
+    if (y <= 0) return 0;
+    
+    size_t offset, index;
+    if (!find_newline(ed, y, &offset, &index)) return doc_length(ed);
+    return offset + 1;
+}
+
+/* Byte at offset */
+static char doc_byte(Editor *ed, size_t offset) {
+    size_t piece_offset;
+    PieceNode *node = piece_at(ed, offset, &piece_offset);
+    return node ? node->piece.buf->data[node->piece.start + (offset - piece_offset)] : '\0';
+}
+
+/* Offset just past the text of line y (starting at start); a '\r' before the newline belongs to the terminator */
+static size_t line_end(Editor *ed, int y, size_t start) {
+    size_t end, index;
+    if (y + 1 >= ed->total_lines || !find_newline(ed, y + 1, &end, &index)) {
+        return doc_length(ed);
+    }
+    if (end > start && doc_byte(ed, end - 1) == '\r') end--;
+    return end;
+}
+
+/* Length of line y in bytes */
+size_t line_length(Editor *ed, int y) {
+    size_t start = line_offset(ed, y);
+    return line_end(ed, y, start) - start;
+}
+
+/* Get line at position - fills a view, returns 0 past the last line */
+int get_line_at(Editor *ed, int y, Line *line) {
+    if (y < 0 || y >= ed->total_lines) return 0;
+    
+    /* Fast path: the newlines before and after the line sit in the same piece */
+    if (y > 0) {
+        size_t offset, index;
+        PieceNode *node = find_newline(ed, y, &offset, &index);
+        const TextBuf *buf = node->piece.buf;
+        if (index + 1 < node->piece.first_nl + node->piece.lf) {
+            size_t nl = newline_at(buf, index);
+            line->data = buf->data + nl + 1;
+            line->len = newline_at(buf, index + 1) - nl - 1;
+            if (line->len > 0 && line->data[line->len - 1] == '\r') line->len--;
+            return 1;
+        }
+    }
+    
+    size_t start = line_offset(ed, y);
+    size_t end = line_end(ed, y, start);
+    line->len = end - start;
+    
+    size_t piece_offset;
+    PieceNode *node = piece_at(ed, start, &piece_offset);
+    if (!node || line->len == 0) {
+        line->data = "";
+    } else if (end <= piece_offset + node->piece.len) {
+        /* Whole line lives in one piece - no copy */
+        line->data = node->piece.buf->data + node->piece.start + (start - piece_offset);
+    } else {
+        if (line->len > line->scratch_cap) {
+            line->scratch_cap = line->len + 128;
+            line->scratch = realloc(line->scratch, line->scratch_cap);
+        }
+        doc_read(ed, start, line->len, line->scratch);
+        line->data = line->scratch;
+    }
+    return 1;
+}
+
+/* Release a line view's scratch storage */
+void line_release(Line *line) {
+    free(line->scratch);
+    line->scratch = NULL;
+    line->scratch_cap = 0;
+    line->data = NULL;
+    line->len = 0;
+}
+
+/* Initialize editor */
+void init_editor(Editor *ed, const char *filename) {
+    debug_log("=== AZ Editor Started ===");
+    debug_log("Filename: %s", filename ? filename : "NULL");
+    memset(ed, 0, sizeof(Editor));
+    
+    /* Empty document - one empty line */
+    ed->total_lines = 1;
+    ed->undo_budget = UNDO_BUDGET;
+    ed->syntax.debounce_ms = SYNTAX_DEBOUNCE_MS;
+    ed->syntax.checked_lang = -1;
+    pthread_mutex_init(&ed->syntax.lock, NULL);
+    pthread_cond_init(&ed->syntax.cond, NULL);
+    
+    if (filename) {
+        ed->filename = strdup(filename);
+        load_file(ed, filename);
+    }
+    
+    /* Initialize ncurses */
+    initscr();
+    debug_log("ncurses initialized");
+    
+    raw();  /* Use raw() to get ALL keys including Ctrl */
+    debug_log("raw() called");
+    
+    keypad(stdscr, TRUE);
+    idlok(stdscr, TRUE);  /* Let scrolled rows move with the terminal's scroll region */
+    define_key("\033[200~", KEY_PASTE_START);
+    define_key("\033[201~", KEY_PASTE_END);
+    debug_log("keypad enabled");
+    
+    noecho();
+    debug_log("noecho set");
+    
+    /* Disable flow control so Ctrl+S/Q work */
+    intrflush(stdscr, FALSE);
+    debug_log("intrflush disabled");
+    
+    timeout(0);
+    debug_log("getch non-blocking - main loop polls stdin");
+    
+    /* Colors */
+    if (has_colors()) {
+        start_color();
+        use_default_colors();
+        init_pair(1, COLOR_CYAN, -1);     /* Line numbers */
+        init_pair(2, COLOR_GREEN, -1);    /* Comments */
+        init_pair(3, COLOR_YELLOW, -1);   /* Strings */
+        init_pair(4, COLOR_MAGENTA, -1);  /* Keywords */
+        init_pair(5, COLOR_BLACK, COLOR_WHITE);  /* Selection */
+        init_pair(6, COLOR_WHITE, COLOR_BLUE);   /* Status bar */
+        init_pair(7, COLOR_RED, -1);      /* Errors */
+    }
+    
+    /* Mouse support */
+    mousemask(ALL_MOUSE_EVENTS | REPORT_MOUSE_POSITION, NULL);
+    mouseinterval(0);
+    
+    /* Enable mouse motion events in terminal */
+    printf("\033[?1003h");  /* Enable any-event mouse tracking */
+    printf("\033[?2004h");  /* Bracket pastes so they arrive as one edit */
+    fflush(stdout);
+    
+    /* Get screen size */
+    getmaxyx(stdscr, ed->screen_height, ed->screen_width);
+    ed->edit_height = ed->screen_height - 2;
+    ed->edit_width = ed->screen_width - LINE_NUMBER_WIDTH - 1;
+    
+    /* We need to ignore signals for Ctrl keys to work */
+    signal(SIGINT, SIG_IGN);   /* Ignore Ctrl+C */
+    signal(SIGTSTP, SIG_IGN);  /* Ignore Ctrl+Z */
+    signal(SIGQUIT, SIG_IGN);  /* Ignore Ctrl+\ */
+    debug_log("Signals ignored");
+    
+    /* Resizes and worker results arrive through the wake pipe */
+    if (pipe(wake_pipe) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+            fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigwinch;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
+}
+
+/* Terminal resized - take the new size from the tty */
+void handle_resize(Editor *ed) {
+    resize_pending = 0;
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0) {
+        resizeterm(ws.ws_row, ws.ws_col);
+    }
+    getmaxyx(stdscr, ed->screen_height, ed->screen_width);
+    ed->edit_height = ed->screen_height - 2;
+    ed->edit_width = ed->screen_width - LINE_NUMBER_WIDTH - 1;
+    if (ed->edit_height < 1) ed->edit_height = 1;
+    if (ed->edit_width < 1) ed->edit_width = 1;
+    ed->render.num_rows = 0;  /* Every row is stale */
+    debug_log("Resized to %dx%d", ed->screen_width, ed->screen_height);
+}
+
+/* Release the original buffer, unmapping it if it came from mmap */
+static void orig_release(TextBuf *orig) {
+    if (orig->mapped) {
+        munmap(orig->data, orig->capacity);
+    } else {
+        free(orig->data);
+    }
+    free(orig->newlines);
+    free(orig->newlines_high);
+    memset(orig, 0, sizeof(TextBuf));
+}
+
+/* Load file - maps it and indexes only the first screens, the rest follows in load_more() */
+void load_file(Editor *ed, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return;
+    
+    /* Checkpoints start over with the new text - once the worker stops reading the old one */
+    syntax_wait(ed);
+    ed->syntax.num_blocks = 0;
+    ed->syntax.num_edits = 0;
+    ed->syntax.tracking = 0;
+    ed->syntax.checked_lang = -1;
+    ed->wrap.width = 0;
+    ed->offset_wrap = 0;
+    match_stop(ed);
+    
+    /* Drop existing document - its tree is the only one */
+    piece_pool_reset();
+    ed->pieces = NULL;
+    orig_release(&ed->orig);
+    
+    struct stat st;
+    char *data = NULL;
+    size_t len = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+        } else {
+            len = st.st_size;
+            ed->orig.mapped = 1;
+            ed->orig.capacity = len;
+            posix_madvise(data, len, POSIX_MADV_SEQUENTIAL);
+        }
+    }
+    
+    if (!data) {
+        /* Pipes, devices and failed maps: read into the heap */
+        size_t cap = 1 << 16;
+        ssize_t n;
+        data = malloc(cap);
+        while ((n = read(fd, data + len, cap - len)) > 0) {
+            len += n;
+            if (len == cap) {
+                cap *= 2;
+                data = realloc(data, cap);
+            }
+        }
+        ed->orig.capacity = cap;
+    }
+    close(fd);
+    
+    ed->orig.data = data;
+    ed->orig.len = len;
+    
+    /* The final newline terminates the last line, it is not part of the text */
+    ed->load_pos = 0;
+    ed->load_end = len;
+    ed->final_eol = (len > 0) ? "" : "\n";
+    if (len > 0 && data[len - 1] == '\n') {
+        ed->load_end--;
+        ed->final_eol = "\n";
+        if (len > 1 && data[len - 2] == '\r') {
+            ed->load_end--;
+            ed->final_eol = "\r\n";
+        }
+    }
+    ed->total_lines = 1;
+    load_more(ed, LOAD_FIRST_CHUNK);
+    
+    /* New lines follow the convention of the first screens */
+    ed->eol = (ed->orig.num_crlf * 2 > ed->orig.num_newlines ||
+               (ed->orig.num_newlines == 0 && ed->final_eol[0] == '\r')) ? "\r\n" : "\n";
+    debug_log("File opened: %zu bytes, %s", len, ed->orig.mapped ? "mapped" : "read");
+}
+
+/*
+ * Index up to budget more bytes of the original file and append them to the
+ * document. Chunks end just before a newline so every loaded line is whole.
+ * Returns 1 while part of the file is still unloaded.
+ */
+int load_more(Editor *ed, size_t budget) {
+    if (ed->load_pos >= ed->load_end) return 0;
+    
+    size_t from = ed->load_pos;
+    size_t to = ed->load_end;
+    size_t lf_before = ed->orig.num_newlines;
+    if (to - from > budget) {
+        /* Index the budget, then run on to the end of the current line (no newlines to record there) */
+        index_newlines(&ed->orig, from, from + budget);
+        const char *nl = memchr(ed->orig.data + from + budget, '\n', to - from - budget);
+        if (nl) {
+            to = nl - ed->orig.data;
+            if (to > from && ed->orig.data[to - 1] == '\r') to--;
+        }
+    } else {
+        index_newlines(&ed->orig, from, to);
+    }
+    
+    if (to > from) {
+        piece_append(ed, &ed->orig, from, to - from);
+    }
+    ed->total_lines += ed->orig.num_newlines - lf_before;
+    ed->load_pos = to;
+    ed->revision++;
+    wrap_note_load(ed, lf_before, to);
+    return ed->load_pos < ed->load_end;
+}
+
+/* Load whatever is left - needed before whole-document operations */
+void load_finish(Editor *ed) {
+    while (load_more(ed, LOAD_CHUNK_SIZE));
+}
+
+/* Write out the queued spans, resuming after short writes */
+static void save_flush(SaveWriter *w) {
+    struct iovec *iov = w->iov;
+    int count = w->count;
+    w->count = 0;
+    while (count > 0 && !w->error) {
+        ssize_t n = writev(w->fd, iov, count);
+        if (n < 0) {
+            if (errno != EINTR) w->error = errno;
+            continue;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void save_push(SaveWriter *w, const char *data, size_t len) {
+    if (len == 0) return;
+    if (w->count == SAVE_IOV_BATCH) save_flush(w);
+    w->iov[w->count].iov_base = (void *)data;
+    w->iov[w->count].iov_len = len;
+    w->count++;
+}
+
+/* Queue the pieces of a subtree in document order */
+static void save_pieces(SaveWriter *w, PieceNode *node) {
+    while (node && !w->error) {
+        save_pieces(w, node->left);
+        save_push(w, node->piece.buf->data + node->piece.start, node->piece.len);
+        node = node->right;
+    }
+}
+
+/* The file a save to filename replaces - symlinks are followed so the link itself survives */
+static char* save_target(const char *filename) {
+    char *path = strdup(filename);
+    for (int depth = 0; depth < SAVE_LINK_DEPTH; depth++) {
+        struct stat st;
+        if (lstat(path, &st) != 0 || !S_ISLNK(st.st_mode)) break;
+        
+        char *dest = malloc(st.st_size + 1);
+        ssize_t n = readlink(path, dest, st.st_size + 1);
+        if (n < 0 || n > st.st_size) {
+            free(dest);
+            break;
+        }
+        dest[n] = '\0';
+        
+        /* A relative link is relative to the directory holding it */
+        const char *slash = strrchr(path, '/');
+        if (dest[0] != '/' && slash) {
+            size_t dir_len = slash - path + 1;
+            char *joined = malloc(dir_len + n + 1);
+            memcpy(joined, path, dir_len);
+            memcpy(joined + dir_len, dest, n + 1);
+            free(dest);
+            dest = joined;
+        }
+        free(path);
+        path = dest;
+    }
+    return path;
+}
+
+/*
+ * Write the document to filename without ever leaving it half written:
+ * the text goes to a temp file in the same directory, is flushed to disk,
+ * and is renamed over the old file, which keeps its mode and owner.
+ * Returns 0 or an errno value.
+ */
+int doc_save(Editor *ed, const char *filename) {
+    load_finish(ed);
+    
+    char *target = save_target(filename);
+    
+    /* The rename would replace a file we may not write to - refuse as opening it would have */
+    if (access(target, W_OK) != 0 && errno != ENOENT) {
+        int err = errno;
+        free(target);
+        return err;
+    }
+    
+    char *tmp_name = malloc(strlen(target) + 11);
+    sprintf(tmp_name, "%s.az-XXXXXX", target);
+    int fd = mkstemp(tmp_name);
+    if (fd < 0) {
+        int err = errno;
+        free(tmp_name);
+        free(target);
+        return err;
+    }
+    
+    /* mkstemp() makes the file 0600 - give it the old file's mode, or the umask default for a new one */
+    struct stat st;
+    mode_t mode;
+    if (stat(target, &st) == 0) {
+        /* Changing the owner is allowed to fail: a user saving someone else's file keeps it as their own */
+        if (fchown(fd, st.st_uid, st.st_gid) != 0 && fchown(fd, (uid_t)-1, st.st_gid) != 0) {
+            debug_log("save: could not keep owner of %s", target);
+        }
+        mode = st.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+    
+    /* Pieces in document order, then the final terminator exactly as loaded */
+    SaveWriter w;
+    w.fd = fd;
+    w.count = 0;
+    w.error = 0;
+    save_pieces(&w, ed->pieces);
+    save_push(&w, ed->final_eol ? ed->final_eol : "\n", ed->final_eol ? strlen(ed->final_eol) : 1);
+    save_flush(&w);
+    
+    int err = w.error;
+    if (!err && fchmod(fd, mode) != 0) err = errno;
+    if (!err && fsync(fd) != 0) err = errno;
+    if (close(fd) != 0 && !err) err = errno;
+    if (!err && rename(tmp_name, target) != 0) err = errno;
+    if (err) {
+        unlink(tmp_name);
+        free(tmp_name);
+        free(target);
+        return err;
+    }
+    
+    /* Make the rename itself durable */
+    const char *slash = strrchr(target, '/');
+    if (slash) {
+        target[slash == target ? 1 : slash - target] = '\0';
+    }
+    int dir = open(slash ? target : ".", O_RDONLY | O_DIRECTORY);
+    if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+    }
+    free(tmp_name);
+    free(target);
+    return 0;
+}
+
+/* Save file */
+void save_file(Editor *ed) {
+    if (!ed->filename) {
+        /* Prompt for filename */
+        echo();
+        curs_set(2);
+        mvprintw(ed->screen_height - 1, 0, "Fayl nomi: ");
+        clrtoeol();
+        refresh();
+        
+        char filename[256];
+        getnstr(filename, sizeof(filename) - 1);
+        
+        noecho();
+        curs_set(1);
+        
+        if (strlen(filename) > 0) {
+            ed->filename = strdup(filename);
+        } else {
+            set_message(ed, "Cancelled");
+            return;
+        }
+    }
+    
+    int err = doc_save(ed, ed->filename);
+    if (err) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Error: Cannot write file: %s", strerror(err));
+        set_message(ed, msg);
+        return;
+    }
+    ed->modified = 0;
+    
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Saqlandi: %s", ed->filename);
+    set_message(ed, msg);
+    
+    /* A new name can change the checker language - that check runs in the background */
+    request_syntax_check(ed);
+}
+
+/* Fill a syntax error */
+static void syntax_set_error(SyntaxError *err, int line, int col_start, int col_end, const char *msg) {
+    err->line = line;
+    err->col_start = col_start;
+    err->col_end = col_end;
+    snprintf(err->msg, sizeof(err->msg), "%s", msg);
+}
+
+/* Checker language for a file name */
+static int syntax_lang(const char *filename) {
+    if (!filename) return SYNTAX_NONE;
+    
+    const char *ext = strrchr(filename, '.');
+    if (!ext) return SYNTAX_NONE;
+    
+    if (strcmp(ext, ".json") == 0) return SYNTAX_JSON;
+    if (strcmp(ext, ".yml") == 0 || strcmp(ext, ".yaml") == 0) return SYNTAX_YAML;
+    if (strcmp(ext, ".py") == 0) return SYNTAX_PYTHON;
+    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".xml") == 0 || strcmp(ext, ".htm") == 0) {
+        return SYNTAX_HTML;
+    }
+    if (strcmp(ext, ".java") == 0 || strcmp(ext, ".c") == 0 || 
+        strcmp(ext, ".cpp") == 0 || strcmp(ext, ".go") == 0 ||
+        strcmp(ext, ".h") == 0 || strcmp(ext, ".hpp") == 0) {
+        return SYNTAX_C;
+    }
+    return SYNTAX_NONE;
+}
+
+/* Track the lowest depths of a block scan */
+static void syntax_track_low(LexState *low, const LexState *st) {
+    if (st->brace < low->brace) low->brace = st->brace;
+    if (st->bracket < low->bracket) low->bracket = st->bracket;
+    if (st->tag_depth < low->tag_depth) low->tag_depth = st->tag_depth;
+}
+
+/*
+ * Scan one line from lexer state st, whose depths are relative to base.
+ * rel is the line's 1-based number inside blk; an error that ends the
+ * check is stored in blk->error and makes this return 1.
+ */
+static int syntax_scan_line(int lang, LexState *st, const LexState *base, const Line *line,
+                            int rel, SyntaxScan *blk) {
+    const char *data = line->data;
+    size_t len = line->len;
+    
+    /* JSON validation */
+    if (lang == SYNTAX_JSON) {
+        for (size_t i = 0; i < len; i++) {
+            char c = data[i];
+            if (c == '"' && (i == 0 || data[i-1] != '\\')) {
+                st->in_string = !st->in_string;
+            }
+            if (!st->in_string) {
+                if (c == '{') st->brace++;
+                if (c == '}') {
+                    st->brace--;
+                    syntax_track_low(&blk->low, st);
+                    if (base->brace + st->brace < 0) {
+                        syntax_set_error(&blk->error, rel, i, i + 1, "Extra '}' - no opening brace");
+                        return 1;
+                    }
+                }
+                if (c == '[') st->bracket++;
+                if (c == ']') {
+                    st->bracket--;
+                    syntax_track_low(&blk->low, st);
+                    if (base->bracket + st->bracket < 0) {
+                        syntax_set_error(&blk->error, rel, i, i + 1, "Extra ']' - no opening bracket");
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+    
+    /* YAML validation - every line stands alone */
+    if (lang == SYNTAX_YAML) {
+        /* Skip comments - YAML comments start with # */
+        size_t comment_start = len;
+        for (size_t i = 0; i < len; i++) {
+            if (data[i] == '#') {
+                comment_start = i;
+                break;
+            }
+        }
+        
+        /* Check for tab characters (YAML doesn't allow tabs) - skip comments */
+        for (size_t i = 0; i < comment_start; i++) {
+            if (data[i] == '\t') {
+                syntax_set_error(&blk->error, rel, i, i + 1, "YAML: TAB not allowed - use spaces");
+                return 1;
+            }
+        }
+        
+        /* Check for unbalanced brackets - skip comments */
+        int brace = 0, bracket = 0;
+        for (size_t i = 0; i < comment_start; i++) {
+            if (data[i] == '{') brace++;
+            if (data[i] == '}') brace--;
+            if (data[i] == '[') bracket++;
+            if (data[i] == ']') bracket--;
+            if (brace < 0 || bracket < 0) {
+                syntax_set_error(&blk->error, rel, i, i + 1, "Bracket balance broken");
+                return 1;
+            }
+        }
+        if (brace != 0 || bracket != 0) {
+            syntax_set_error(&blk->error, rel, 0, comment_start, "Bracket not closed");
+            return 1;
+        }
+    }
+    
+    /* Python - only record indentation style, the verdict needs the whole file */
+    if (lang == SYNTAX_PYTHON) {
+        /* Leading whitespace mixing TAB and spaces */
+        int has_tab = 0, has_space = 0;
+        for (size_t i = 0; i < len && (data[i] == ' ' || data[i] == '\t'); i++) {
+            if (data[i] == '\t') has_tab = 1;
+            if (data[i] == ' ') has_space = 1;
+        }
+        if (has_tab && has_space && blk->first_mixed == 0) {
+            blk->first_mixed = rel;
+        }
+        
+        /* Skip comments - check if first non-whitespace is # */
+        int has_content = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (data[i] != ' ' && data[i] != '\t') {
+                has_content = (data[i] != '#');
+                break;
+            }
+        }
+        
+        /* Check indentation */
+        if (has_content) {
+            if (data[0] == '\t' && blk->first_tab == 0) {
+                blk->first_tab = rel;
+            } else if (data[0] == ' ' && blk->first_space == 0) {
+                blk->first_space = rel;
+            }
+        }
+    }
+    
+    /* HTML/XML validation */
+    if (lang == SYNTAX_HTML) {
+        for (size_t i = 0; i < len; i++) {
+            /* Check for comment start <!-- */
+            if (!st->in_comment && i + 3 < len && 
+                data[i] == '<' && data[i+1] == '!' && 
+                data[i+2] == '-' && data[i+3] == '-') {
+                st->in_comment = 1;
+                i += 3;
+                continue;
+            }
+            /* Check for comment end --> */
+            if (st->in_comment && i + 2 < len && 
+                data[i] == '-' && data[i+1] == '-' && data[i+2] == '>') {
+                st->in_comment = 0;
+                i += 2;
+                continue;
+            }
+            
+            /* Skip if in comment */
+            if (st->in_comment) continue;
+            
+            if (data[i] == '<' && i + 1 < len) {
+                if (data[i+1] != '/' && data[i+1] != '!' && data[i+1] != '?') {
+                    /* Check for self-closing tag like <br/> or <img/> */
+                    int is_self_closing = 0;
+                    for (size_t j = i; j < len; j++) {
+                        if (data[j] == '/' && j + 1 < len && data[j+1] == '>') {
+                            is_self_closing = 1;
+                            break;
+                        }
+                        if (data[j] == '>') break;
+                    }
+                    if (!is_self_closing) {
+                        st->tag_depth++;
+                    }
+                } else if (data[i+1] == '/') {
+                    /* Closing tag */
+                    st->tag_depth--;
+                    syntax_track_low(&blk->low, st);
+                    if (base->tag_depth + st->tag_depth < 0) {
+                        syntax_set_error(&blk->error, rel, i, i + 2, "Extra closing tag - no opening tag");
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+    
+    /* Java/C/C++/Go validation */
+    if (lang == SYNTAX_C) {
+        for (size_t i = 0; i < len; i++) {
+            char c = data[i];
+            
+            /* Check for single-line comment */
+            if (!st->in_string && !st->in_comment && 
+                c == '/' && i + 1 < len && data[i+1] == '/') {
+                break;  /* Rest of line is comment */
+            }
+            
+            /* Check for multi-line comment start */
+            if (!st->in_string && !st->in_comment && 
+                c == '/' && i + 1 < len && data[i+1] == '*') {
+                st->in_comment = 1;
+                i++;  /* Skip star */
+                continue;
+            }
+            
+            /* Check for multi-line comment end */
+            if (st->in_comment && 
+                c == '*' && i + 1 < len && data[i+1] == '/') {
+                st->in_comment = 0;
+                i++;  /* Skip slash */
+                continue;
+            }
+            
+            /* Skip if in comment */
+            if (st->in_comment) continue;
+            
+            /* Check for strings */
+            if (c == '"' && (i == 0 || data[i-1] != '\\')) {
+                st->in_string = !st->in_string;
+                continue;
+            }
+            
+            /* Skip if in string */
+            if (st->in_string) continue;
+            
+            /* Check braces */
+            if (c == '{') {
+                st->brace++;
+            } else if (c == '}') {
+                st->brace--;
+                syntax_track_low(&blk->low, st);
+                if (base->brace + st->brace < 0) {
+                    syntax_set_error(&blk->error, rel, i, i + 1, "Extra '}' - no opening brace");
+                    return 1;
+                }
+            }
+        }
+    }
+    
+    return 0;
+}
+
+/* Line reader over a job snapshot */
+typedef struct {
+    const SyntaxJob *job;
+    size_t piece;           /* Current piece */
+    size_t pos;             /* Offset inside it */
+    int y;                  /* Line about to be read */
+} SnapReader;
+
+/* Position the reader at the start of line y */
+static void snap_seek(SnapReader *r, int y) {
+    const SyntaxJob *job = r->job;
+    r->piece = 0;
+    r->pos = 0;
+    r->y = y;
+    if (y == 0 || job->num_pieces == 0) return;
+    
+    /* Piece holding the y-th newline (1-based) */
+    size_t k = y - 1, lo = 0, hi = job->num_pieces - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo + 1) / 2;
+        if (job->lf_before[mid] <= k) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    const Piece *piece = &job->pieces[lo];
+    size_t nl = newline_at(piece->buf, piece->first_nl + (k - job->lf_before[lo]));
+    r->piece = lo;
+    r->pos = nl + 1 - piece->start;
+}
+
+/* Read the next line into a view, copying only when it spans pieces */
+static int snap_next_line(SnapReader *r, Line *line) {
+    const SyntaxJob *job = r->job;
+    if (r->y >= job->total_lines) return 0;
+    r->y++;
+    
+    int copied = 0, ended = 0;
+    line->data = "";
+    line->len = 0;
+    while (r->piece < job->num_pieces) {
+        const Piece *piece = &job->pieces[r->piece];
+        const char *data = piece->buf->data + piece->start + r->pos;
+        size_t avail = piece->len - r->pos;
+        const char *nl = memchr(data, '\n', avail);
+        size_t n = nl ? (size_t)(nl - data) : avail;
+        
+        if (n > 0 && line->len == 0) {
+            line->data = data;
+            line->len = n;
+        } else if (n > 0) {
+            /* Line continues from the previous piece - gather it in scratch */
+            if (line->len + n > line->scratch_cap) {
+                line->scratch_cap = line->len + n + 128;
+                char *scratch = realloc(copied ? line->scratch : NULL, line->scratch_cap);
+                if (!copied) {
+                    free(line->scratch);
+                    memcpy(scratch, line->data, line->len);
+                }
+                line->scratch = scratch;
+            } else if (!copied) {
+                memcpy(line->scratch, line->data, line->len);
+            }
+            copied = 1;
+            memcpy(line->scratch + line->len, data, n);
+            line->len += n;
+            line->data = line->scratch;
+        }
+        
+        r->pos += n + (nl ? 1 : 0);
+        if (r->pos >= piece->len) {
+            r->piece++;
+            r->pos = 0;
+        }
+        if (nl) {
+            ended = 1;
+            break;
+        }
+    }
+    
+    /* A '\r' before the newline belongs to the terminator */
+    if (ended && line->len > 0 && line->data[line->len - 1] == '\r') line->len--;
+    return 1;
+}
+
+/* Scan the lines of a block starting at line start; base holds the absolute depths at its entry */
+static void syntax_scan_block(const SyntaxJob *job, const SyntaxBlock *blk, SyntaxScan *scan,
+                              int start, const LexState *base, Line *line) {
+    LexState st = scan->entry;
+    st.brace = st.bracket = st.tag_depth = 0;
+    memset(&scan->error, 0, sizeof(SyntaxError));
+    memset(&scan->low, 0, sizeof(LexState));
+    scan->first_tab = scan->first_space = scan->first_mixed = 0;
+    
+    SnapReader reader = { job, 0, 0, 0 };
+    snap_seek(&reader, start);
+    for (int i = 0; i < blk->lines && snap_next_line(&reader, line); i++) {
+        if (syntax_scan_line(job->lang, &st, base, line, i + 1, scan)) break;
+    }
+    scan->exit = st;
+}
+
+/* Scan of a block for the given entry flags - cached, computed on a miss */
+static SyntaxScan* syntax_block_scan(const SyntaxJob *job, SyntaxBlock *blk, int start,
+                                     const LexState *st, Line *line) {
+    /* Depths large enough that a summary scan never reports them as negative */
+    static const LexState unbounded = { INT_MAX / 2, INT_MAX / 2, INT_MAX / 2, 0, 0 };
+    
+    if (blk->dirty) {
+        blk->num_scans = 0;
+        blk->dirty = 0;
+    }
+    for (int i = 0; i < blk->num_scans; i++) {
+        if (blk->scans[i].entry.in_string == st->in_string &&
+            blk->scans[i].entry.in_comment == st->in_comment) {
+            if (i > 0) {
+                SyntaxScan hit = blk->scans[i];
+                blk->scans[i] = blk->scans[0];
+                blk->scans[0] = hit;
+            }
+            return &blk->scans[0];
+        }
+    }
+    
+    if (blk->num_scans > 0) blk->scans[1] = blk->scans[0];
+    if (blk->num_scans < 2) blk->num_scans++;
+    SyntaxScan *scan = &blk->scans[0];
+    memset(&scan->entry, 0, sizeof(LexState));
+    scan->entry.in_string = st->in_string;
+    scan->entry.in_comment = st->in_comment;
+    syntax_scan_block(job, blk, scan, start, &unbounded, line);
+    return scan;
+}
+
+/*
+ * Validate the document.  Every block of lines remembers the lexer flags
+ * it was scanned from; a block is rescanned only if its text changed or
+ * the flags flowing into it differ, so an edit costs one block plus a
+ * walk over the block summaries.  Only the block where a depth first
+ * drops below zero is scanned again to place the error.
+ */
+static void syntax_run_job(SyntaxIndex *si, const SyntaxJob *job, SyntaxError *err) {
+    int lang = job->lang;
+    
+    /* Rebuild checkpoints when the language changes (new file name), else replay the edits */
+    if (lang != si->lang || job->rebuild || (si->num_blocks == 0 && lang != SYNTAX_NONE)) {
+        si->num_blocks = 0;
+        si->lang = lang;
+        if (lang != SYNTAX_NONE) {
+            int count = (job->total_lines + SYNTAX_BLOCK_LINES - 1) / SYNTAX_BLOCK_LINES;
+            syntax_insert_blocks(si, 0, count);
+            for (int i = 0; i < count; i++) {
+                si->blocks[i].lines = (i < count - 1) ? SYNTAX_BLOCK_LINES
+                                                     : job->total_lines - SYNTAX_BLOCK_LINES * (count - 1);
+            }
+        }
+    } else {
+        for (int i = 0; i < job->num_edits; i++) {
+            syntax_apply_edit(si, &job->edits[i]);
+        }
+    }
+    
+    memset(err, 0, sizeof(SyntaxError));
+    if (lang == SYNTAX_NONE) return;
+    
+    Line view = {0};
+    Line *line = &view;
+    LexState st = {0};
+    int start = 0;
+    int first_tab_line = 0, first_space_line = 0, first_mixed_line = 0;
+    for (int b = 0; b < si->num_blocks; b++) {
+        /* Quitting - nobody will read the verdict, so don't hold up the join */
+        if (__atomic_load_n(&si->quit, __ATOMIC_RELAXED)) {
+            line_release(line);
+            return;
+        }
+        SyntaxBlock *blk = &si->blocks[b];
+        SyntaxScan *scan = syntax_block_scan(job, blk, start, &st, line);
+        const SyntaxError *found = &scan->error;  /* YAML lines stand alone */
+        SyntaxScan exact;
+        if (st.brace + scan->low.brace < 0 || st.bracket + scan->low.bracket < 0 ||
+            st.tag_depth + scan->low.tag_depth < 0) {
+            /* A closer without an opener lands here - scan again with real depths to find it */
+            exact = *scan;
+            syntax_scan_block(job, blk, &exact, start, &st, line);
+            found = &exact.error;
+        }
+        if (found->line > 0) {
+            *err = *found;
+            err->line += start;
+            line_release(line);
+            return;
+        }
+        if (scan->first_tab && !first_tab_line) first_tab_line = start + scan->first_tab;
+        if (scan->first_space && !first_space_line) first_space_line = start + scan->first_space;
+        if (scan->first_mixed && !first_mixed_line) first_mixed_line = start + scan->first_mixed;
+        st.brace += scan->exit.brace;
+        st.bracket += scan->exit.bracket;
+        st.tag_depth += scan->exit.tag_depth;
+        st.in_string = scan->exit.in_string;
+        st.in_comment = scan->exit.in_comment;
+        start += blk->lines;
+    }
+    
+    line_release(line);
+    
+    /* Whole-file verdicts */
+    if (lang == SYNTAX_JSON || lang == SYNTAX_C) {
+        if (st.brace != 0) {
+            err->line = job->total_lines;
+            snprintf(err->msg, sizeof(err->msg), "Unclosed '{' - %d open brace(s)", st.brace);
+            return;
+        }
+        if (lang == SYNTAX_JSON && st.bracket != 0) {
+            err->line = job->total_lines;
+            snprintf(err->msg, sizeof(err->msg), "Unclosed '[' - %d open bracket(s)", st.bracket);
+            return;
+        }
+    }
+    
+    if (lang == SYNTAX_PYTHON) {
+        if (first_tab_line > 0 && first_space_line > 0) {
+            /* File uses both! Report the later one as error */
+            err->col_start = 0;
+            err->col_end = 1;
+            if (first_tab_line < first_space_line) {
+                err->line = first_space_line;
+                snprintf(err->msg, sizeof(err->msg), 
+                        "Spaces used but file uses TABs (L%d)", first_tab_line);
+            } else {
+                err->line = first_tab_line;
+                snprintf(err->msg, sizeof(err->msg), 
+                        "TAB used but file uses spaces (L%d)", first_space_line);
+            }
+            return;
+        }
+        if (first_mixed_line > 0) {
+            syntax_set_error(err, first_mixed_line, 0, 1, "Mixed TAB and spaces on line");
+            return;
+        }
+    }
+    
+    if (lang == SYNTAX_HTML && st.tag_depth != 0) {
+        err->line = job->total_lines;
+        snprintf(err->msg, sizeof(err->msg), "Unclosed tag - %d open tag(s)", st.tag_depth);
+    }
+}
+
+/* Milliseconds on the monotonic clock */
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Snapshot the document for a job.  Text buffers are append-only and
+ * only the newest add chunk still grows its newline index, so copying
+ * that index and the piece list is enough for the worker to read the
+ * text while the main thread keeps editing.
+ */
+static void syntax_fill_job(Editor *ed, SyntaxJob *job) {
+    SyntaxIndex *si = &ed->syntax;
+    size_t cap = 0;
+    job->pieces = NULL;
+    job->num_pieces = 0;
+    piece_collect(ed->pieces, &job->pieces, &job->num_pieces, &cap);
+    job->lf_before = malloc(sizeof(size_t) * (job->num_pieces + 1));
+    
+    memset(&job->active, 0, sizeof(TextBuf));
+    if (ed->add) {
+        job->active = *ed->add;
+        job->active.newlines = malloc(sizeof(uint32_t) * (ed->add->num_newlines + 1));
+        if (ed->add->num_newlines) {
+            memcpy(job->active.newlines, ed->add->newlines, sizeof(uint32_t) * ed->add->num_newlines);
+        }
+        job->active.newlines_cap = ed->add->num_newlines;
+        job->active.newlines_high = malloc(sizeof(size_t) * (ed->add->num_high + 1));
+        if (ed->add->num_high) {
+            memcpy(job->active.newlines_high, ed->add->newlines_high, sizeof(size_t) * ed->add->num_high);
+        }
+    }
+    
+    size_t lf = 0;
+    for (size_t i = 0; i < job->num_pieces; i++) {
+        if (job->pieces[i].buf == ed->add) job->pieces[i].buf = &job->active;
+        job->lf_before[i] = lf;
+        lf += job->pieces[i].lf;
+    }
+    
+    job->total_lines = ed->total_lines;
+    job->lang = syntax_lang(ed->filename);
+    job->revision = ed->revision;
+    
+    /* Hand over the queued line edits; the checkpoints exist from now on */
+    job->edits = si->edits;
+    job->num_edits = si->num_edits;
+    job->rebuild = !si->tracking;
+    si->edits = NULL;
+    si->num_edits = 0;
+    si->edits_cap = 0;
+    si->tracking = (job->lang != SYNTAX_NONE);
+    si->runs++;
+    debug_log("Syntax check #%lu at revision %lu (%lu skipped, %zu pieces)",
+              si->runs, job->revision, si->skipped, job->num_pieces);
+}
+
+/* Free the arrays of a finished job */
+static void syntax_job_release(SyntaxJob *job) {
+    free(job->pieces);
+    free(job->lf_before);
+    free(job->active.newlines);
+    free(job->active.newlines_high);
+    free(job->edits);
+    job->pieces = NULL;
+    job->lf_before = NULL;
+    job->active.newlines = NULL;
+    job->active.newlines_high = NULL;
+    job->edits = NULL;
+    job->num_pieces = 0;
+    job->num_edits = 0;
+}
+
+/* Validation thread - runs one job at a time, the main thread picks up the result */
+static void* syntax_worker(void *arg) {
+    SyntaxIndex *si = arg;
+    pthread_mutex_lock(&si->lock);
+    while (1) {
+        while (!si->busy && !si->quit) {
+            pthread_cond_wait(&si->cond, &si->lock);
+        }
+        if (si->quit) break;
+        pthread_mutex_unlock(&si->lock);
+        
+        SyntaxError err;
+        syntax_run_job(si, &si->job, &err);
+        syntax_job_release(&si->job);
+        
+        pthread_mutex_lock(&si->lock);
+        si->result = err;
+        si->done = 1;
+        si->busy = 0;
+        pthread_cond_broadcast(&si->cond);
+        wake_main_loop();
+    }
+    pthread_mutex_unlock(&si->lock);
+    return NULL;
+}
+
+/* Take a finished result; one for an older revision or file name is dropped. Returns 1 while a job runs */
+int syntax_poll(Editor *ed) {
+    SyntaxIndex *si = &ed->syntax;
+    if (!si->started) return 0;
+    
+    pthread_mutex_lock(&si->lock);
+    int busy = si->busy;
+    if (si->done) {
+        si->done = 0;
+        if (si->job.revision == ed->revision && si->job.lang == syntax_lang(ed->filename)) {
+            ed->syntax_error = si->result;
+            si->revision = si->job.revision;
+            si->checked_lang = si->job.lang;
+        } else {
+            debug_log("Syntax result for revision %lu is stale (now %lu)", si->job.revision, ed->revision);
+        }
+    }
+    pthread_mutex_unlock(&si->lock);
+    return busy;
+}
+
+/* Block until the worker is idle, then take its result */
+void syntax_wait(Editor *ed) {
+    SyntaxIndex *si = &ed->syntax;
+    if (!si->started) return;
+    
+    pthread_mutex_lock(&si->lock);
+    while (si->busy) {
+        pthread_cond_wait(&si->cond, &si->lock);
+    }
+    pthread_mutex_unlock(&si->lock);
+    syntax_poll(ed);
+}
+
+/* A validation is pending or running - the verdict on screen may be out of date */
+static int syntax_checking(Editor *ed) {
+    SyntaxIndex *si = &ed->syntax;
+    if (si->due_ms) return 1;
+    if (!si->started) return 0;
+    
+    pthread_mutex_lock(&si->lock);
+    int busy = si->busy || si->done;
+    pthread_mutex_unlock(&si->lock);
+    return busy;
+}
+
+/* The verdict on screen already covers this text and file name */
+static int syntax_current(Editor *ed) {
+    if (ed->syntax.revision == ed->revision && ed->syntax.checked_lang == syntax_lang(ed->filename)) {
+        ed->syntax.skipped++;
+        return 1;
+    }
+    return 0;
+}
+
+/* A half-loaded document would report unclosed brackets - wait for the rest */
+static int syntax_loading(Editor *ed) {
+    if (ed->load_pos < ed->load_end) {
+        ed->syntax_error.line = 0;
+        ed->syntax_error.msg[0] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+/* No checker for this file name - drop what a former name reported and stop queueing edits */
+static int syntax_none(Editor *ed) {
+    SyntaxIndex *si = &ed->syntax;
+    if (syntax_lang(ed->filename) != SYNTAX_NONE) return 0;
+    
+    si->due_ms = 0;
+    si->tracking = 0;
+    si->num_edits = 0;
+    si->revision = ed->revision;
+    si->checked_lang = SYNTAX_NONE;
+    ed->syntax_error.line = 0;
+    ed->syntax_error.msg[0] = '\0';
+    return 1;
+}
+
+/* Ask for validation once the edits pause - a burst of keys ends in one check */
+void request_syntax_check(Editor *ed) {
+    if (syntax_none(ed)) return;
+    if (!ed->syntax.due_ms && syntax_current(ed)) return;
+    if (ed->syntax.due_ms) ed->syntax.skipped++;
+    ed->syntax.due_ms = now_ms() + ed->syntax.debounce_ms;
+}
+
+/* Start the pending validation on the worker once its deadline passes. Returns 1 while one runs */
+int syntax_service(Editor *ed) {
+    SyntaxIndex *si = &ed->syntax;
+    if (syntax_poll(ed)) return 1;
+    if (!si->due_ms || now_ms() < si->due_ms) return 0;
+    
+    si->due_ms = 0;
+    if (syntax_loading(ed) || syntax_none(ed) || syntax_current(ed)) return 0;
+    
+    if (!si->started) {
+        if (pthread_create(&si->thread, NULL, syntax_worker, si) != 0) {
+            /* No thread - validate in place */
+            check_syntax_error(ed);
+            return 0;
+        }
+        si->started = 1;
+    }
+    pthread_mutex_lock(&si->lock);
+    syntax_fill_job(ed, &si->job);
+    si->busy = 1;
+    pthread_cond_broadcast(&si->cond);
+    pthread_mutex_unlock(&si->lock);
+    return 1;
+}
+
+/* Check syntax errors for all file types - with detailed error info, before returning */
+void check_syntax_error(Editor *ed) {
+    SyntaxIndex *si = &ed->syntax;
+    si->due_ms = 0;
+    syntax_wait(ed);
+    if (syntax_loading(ed) || syntax_none(ed) || syntax_current(ed)) return;
+    
+    SyntaxJob job;
+    syntax_fill_job(ed, &job);
+    syntax_run_job(si, &job, &ed->syntax_error);
+    si->revision = job.revision;
+    si->checked_lang = job.lang;
+    syntax_job_release(&job);
+}
+
+/* Set message */
+void set_message(Editor *ed, const char *msg) {
+    strncpy(ed->message, msg, sizeof(ed->message) - 1);
+    ed->message_until = now_ms() + MESSAGE_TIMEOUT_MS;
+}
+
+/* Columns [*from, *to) of line y inside the selection - empty when it is not selected */
+static void selection_span(Editor *ed, int y, int *from, int *to) {
+    *from = *to = 0;
+    if (!ed->sel_active) return;
+    
+    int sy = ed->sel_start_y, sx = ed->sel_start_x;
+    int ey = ed->sel_end_y, ex = ed->sel_end_x;
+    
+    /* Normalize selection */
+    if (sy > ey || (sy == ey && sx > ex)) {
+        int tmp;
+        tmp = sy; sy = ey; ey = tmp;
+        tmp = sx; sx = ex; ex = tmp;
+    }
+    
+    if (y < sy || y > ey) return;
+    *from = (y == sy) ? sx : 0;
+    *to = (y == ey) ? ex : INT_MAX;
+}
+
+/* Columns [*from, *to) of line y marked by the syntax error */
+static void error_span(Editor *ed, int y, int len, int *from, int *to) {
+    *from = *to = 0;
+    if (ed->syntax_error.line <= 0 || y + 1 != ed->syntax_error.line) return;
+    
+    if (ed->syntax_error.col_end > ed->syntax_error.col_start) {
+        /* Specific position error */
+        *from = ed->syntax_error.col_start;
+        *to = ed->syntax_error.col_end;
+    } else {
+        /* Whole line error */
+        *to = len;
+    }
+}
+
+/* FNV-1a over a row's bytes, seeded with what else decides its look */
+static unsigned long long row_hash(const int *attrs, int num_attrs, const char *text, int len) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (int i = 0; i < num_attrs; i++) {
+        h = (h ^ (unsigned)attrs[i]) * 1099511628211ULL;
+    }
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)text[i]) * 1099511628211ULL;
+    }
+    return h | 1;  /* 0 marks an unknown row */
 }
 
-/* Get line at position */
-Line* get_line_at(Editor *ed, int y) {
-    Line *line = ed->first_line;
-    for (int i = 0; i < y && line; i++) {
-        line = line->next;
+/* Row already shows this content - otherwise remember it and clear the row for drawing */
+static int render_row_current(Editor *ed, int row, unsigned long long hash) {
+    RenderCache *rc = &ed->render;
+    if (rc->rows[row] == hash) {
+        rc->skipped++;
+        return 1;
     }
-    return line;
+    rc->rows[row] = hash;
+    rc->drawn++;
+    move(row, 0);
+    clrtoeol();
+    return 0;
 }
 
-/* Check syntax errors for all file types - with detailed error info */
-void check_syntax_error(Editor *ed) {
-    /* Clear previous error */
-    ed->syntax_error.line = 0;
-    ed->syntax_error.col_start = 0;
-    ed->syntax_error.col_end = 0;
-    ed->syntax_error.msg[0] = '\0';
-    
-    if (!ed->filename) return;
-    
-    const char *ext = strrchr(ed->filename, '.');
-    if (!ext) return;
+/*
+ * Line up the row cache with this frame.  A scroll of fewer rows than
+ * the text area shifts the window inside a scroll region so ncurses can
+ * scroll the terminal instead of repainting every row.
+ */
+static void render_prepare(Editor *ed, int top) {
+    RenderCache *rc = &ed->render;
+    if (rc->num_rows != ed->edit_height || rc->width != ed->edit_width) {
+        free(rc->rows);
+        rc->rows = calloc(ed->edit_height, sizeof(unsigned long long));
+        rc->num_rows = ed->edit_height;
+        rc->width = ed->edit_width;
+        rc->top = top;
+        return;
+    }
+    if (rc->top == top) return;
     
-    Line *line = ed->first_line;
-    int line_num = 1;
+    int shift = top - rc->top;
+    rc->top = top;
     
-    /* JSON validation */
-    if (strcmp(ext, ".json") == 0) {
-        int brace_count = 0, bracket_count = 0;
-        int in_string = 0;
-        
-        line = ed->first_line;
-        line_num = 1;
-        while (line) {
-            for (size_t i = 0; i < line->len; i++) {
-                char c = line->data[i];
-                if (c == '"' && (i == 0 || line->data[i-1] != '\\')) {
-                    in_string = !in_string;
-                }
-                if (!in_string) {
-                    if (c == '{') brace_count++;
-                    if (c == '}') {
-                        brace_count--;
-                        if (brace_count < 0) {
-                            ed->syntax_error.line = line_num;
-                            ed->syntax_error.col_start = i;
-                            ed->syntax_error.col_end = i + 1;
-                            snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                                    "Extra '}' - no opening brace");
-                            return;
-                        }
-                    }
-                    if (c == '[') bracket_count++;
-                    if (c == ']') {
-                        bracket_count--;
-                        if (bracket_count < 0) {
-                            ed->syntax_error.line = line_num;
-                            ed->syntax_error.col_start = i;
-                            ed->syntax_error.col_end = i + 1;
-                            snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                                    "Extra ']' - no opening bracket");
-                            return;
-                        }
-                    }
-                }
-            }
-            line = line->next;
-            line_num++;
-        }
-        if (brace_count != 0) {
-            ed->syntax_error.line = line_num - 1;
-            ed->syntax_error.col_start = 0;
-            ed->syntax_error.col_end = 0;
-            snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                    "Unclosed '{' - %d open brace(s)", brace_count);
-            return;
-        }
-        if (bracket_count != 0) {
-            ed->syntax_error.line = line_num - 1;
-            ed->syntax_error.col_start = 0;
-            ed->syntax_error.col_end = 0;
-            snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                    "Unclosed '[' - %d open bracket(s)", bracket_count);
-            return;
-        }
+    int n = rc->num_rows;
+    if (shift >= n || -shift >= n) {
+        memset(rc->rows, 0, sizeof(unsigned long long) * n);
+        return;
     }
-    
-    /* YAML validation */
-    if (strcmp(ext, ".yml") == 0 || strcmp(ext, ".yaml") == 0) {
-        line = ed->first_line;
-        line_num = 1;
-        while (line) {
-            /* Skip comments - YAML comments start with # */
-            size_t comment_start = line->len;
-            for (size_t i = 0; i < line->len; i++) {
-                if (line->data[i] == '#') {
-                    comment_start = i;
-                    break;
-                }
-            }
-            
-            /* Check for tab characters (YAML doesn't allow tabs) - skip comments */
-            for (size_t i = 0; i < comment_start; i++) {
-                if (line->data[i] == '\t') {
-                    ed->syntax_error.line = line_num;
-                    ed->syntax_error.col_start = i;
-                    ed->syntax_error.col_end = i + 1;
-                    snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                            "YAML: TAB not allowed - use spaces");
-                    return;
-                }
-            }
-            
-            /* Check for unbalanced brackets - skip comments */
-            int brace = 0, bracket = 0;
-            for (size_t i = 0; i < comment_start; i++) {
-                if (line->data[i] == '{') brace++;
-                if (line->data[i] == '}') brace--;
-                if (line->data[i] == '[') bracket++;
-                if (line->data[i] == ']') bracket--;
-                if (brace < 0 || bracket < 0) {
-                    ed->syntax_error.line = line_num;
-                    ed->syntax_error.col_start = i;
-                    ed->syntax_error.col_end = i + 1;
-                    snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                            "Bracket balance broken");
-                    return;
-                }
-            }
-            if (brace != 0 || bracket != 0) {
-                ed->syntax_error.line = line_num;
-                ed->syntax_error.col_start = 0;
-                ed->syntax_error.col_end = comment_start;
-                snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                        "Bracket not closed");
-                return;
-            }
-            line = line->next;
-            line_num++;
-        }
+    setscrreg(0, n - 1);
+    scrollok(stdscr, TRUE);
+    wscrl(stdscr, shift);
+    scrollok(stdscr, FALSE);
+    setscrreg(0, ed->screen_height - 1);
+    if (shift > 0) {
+        memmove(rc->rows, rc->rows + shift, sizeof(unsigned long long) * (n - shift));
+        memset(rc->rows + n - shift, 0, sizeof(unsigned long long) * shift);
+    } else {
+        memmove(rc->rows - shift, rc->rows, sizeof(unsigned long long) * (n + shift));
+        memset(rc->rows, 0, sizeof(unsigned long long) * -shift);
+    }
+}
+
+/*
+ * Draw len bytes of text on a row.  The selection [sel_from, sel_to) and
+ * error [err_from, err_to) columns (-1 if none) split the row into runs
+ * of one attribute; each run is filled into the cell buffer in a tight
+ * loop and the row goes out with a single mvaddchnstr().  TABs and other
+ * control bytes take one cell, as they did with mvaddch().
+ */
+static void render_text(Editor *ed, int row, const char *text, int len,
+                        int sel_from, int sel_to, int err_from, int err_to) {
+    RenderCache *rc = &ed->render;
+    if (len <= 0) return;
+    if (len > rc->cells_cap) {
+        rc->cells_cap = len;
+        rc->cells = realloc(rc->cells, sizeof(chtype) * rc->cells_cap);
     }
     
-    /* Python validation - simplified and more reliable */
-    if (strcmp(ext, ".py") == 0) {
-        /* Scan whole file to determine indentation style */
-        int first_tab_line = 0;
-        int first_space_line = 0;
-        
-        line = ed->first_line;
-        line_num = 1;
-        
-        /* First pass: find first indented line with tabs and spaces */
-        while (line && (first_tab_line == 0 || first_space_line == 0)) {
-            /* Skip empty lines */
-            if (line->len == 0) {
-                line = line->next;
-                line_num++;
-                continue;
-            }
-            
-            /* Skip comments - check if first non-whitespace is # */
-            int has_content = 0;
-            for (size_t i = 0; i < line->len; i++) {
-                if (line->data[i] != ' ' && line->data[i] != '\t') {
-                    has_content = 1;
-                    if (line->data[i] == '#') {
-                        has_content = 0;  /* It's a comment */
-                    }
-                    break;
-                }
-            }
-            
-            if (!has_content) {
-                line = line->next;
-                line_num++;
-                continue;
-            }
-            
-            /* Check indentation */
-            if (line->len > 0 && (line->data[0] == ' ' || line->data[0] == '\t')) {
-                if (line->data[0] == '\t' && first_tab_line == 0) {
-                    first_tab_line = line_num;
-                } else if (line->data[0] == ' ' && first_space_line == 0) {
-                    first_space_line = line_num;
-                }
+    int i = 0;
+    while (i < len) {
+        /* Attribute of column i and where it changes */
+        int run_end = len;
+        chtype attr = A_NORMAL;
+        int is_error = 0;
+        if (i >= err_from && i < err_to) {
+            attr = COLOR_PAIR(3) | A_UNDERLINE;  /* Red underline */
+            is_error = 1;
+            run_end = err_to;
+        } else {
+            if (i >= sel_from && i < sel_to) {
+                attr = COLOR_PAIR(5);
+                run_end = sel_to;
+            } else if (sel_from > i && sel_from < run_end) {
+                run_end = sel_from;
             }
-            
-            line = line->next;
-            line_num++;
+            if (err_from > i && err_from < run_end) run_end = err_from;
         }
+        if (run_end > len) run_end = len;
         
-        /* Second pass: check for violations */
-        if (first_tab_line > 0 && first_space_line > 0) {
-            /* File uses both! Report the later one as error */
-            if (first_tab_line < first_space_line) {
-                ed->syntax_error.line = first_space_line;
-                ed->syntax_error.col_start = 0;
-                ed->syntax_error.col_end = 1;
-                snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                        "Spaces used but file uses TABs (L%d)", first_tab_line);
+        for (; i < run_end; i++) {
+            unsigned char c = text[i];
+            chtype cell;
+            if (c == '\t') {
+                cell = is_error ? '^' : ' ';  /* For error display, show TAB as '^' */
+            } else if (c == ' ') {
+                cell = is_error ? '_' : ' ';  /* ... and keep space visible */
+            } else if (c < 32 || c >= 127) {
+                cell = (unsigned char)unctrl(c)[0];
             } else {
-                ed->syntax_error.line = first_tab_line;
-                ed->syntax_error.col_start = 0;
-                ed->syntax_error.col_end = 1;
-                snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                        "TAB used but file uses spaces (L%d)", first_space_line);
-            }
-            return;
-        }
-        
-        /* Also check for mixed on same line */
-        line = ed->first_line;
-        line_num = 1;
-        while (line) {
-            int has_tab = 0, has_space = 0;
-            for (size_t i = 0; i < line->len && (line->data[i] == ' ' || line->data[i] == '\t'); i++) {
-                if (line->data[i] == '\t') has_tab = 1;
-                if (line->data[i] == ' ') has_space = 1;
-            }
-            if (has_tab && has_space) {
-                ed->syntax_error.line = line_num;
-                ed->syntax_error.col_start = 0;
-                ed->syntax_error.col_end = 1;
-                snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                        "Mixed TAB and spaces on line");
-                return;
-            }
-            line = line->next;
-            line_num++;
-        }
-    }
-    
-    /* HTML/XML validation */
-    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".xml") == 0 || strcmp(ext, ".htm") == 0) {
-        int tag_depth = 0;
-        int in_comment = 0;
-        line = ed->first_line;
-        line_num = 1;
-        while (line) {
-            for (size_t i = 0; i < line->len; i++) {
-                /* Check for comment start <!-- */
-                if (!in_comment && i + 3 < line->len && 
-                    line->data[i] == '<' && line->data[i+1] == '!' && 
-                    line->data[i+2] == '-' && line->data[i+3] == '-') {
-                    in_comment = 1;
-                    i += 3;
-                    continue;
-                }
-                /* Check for comment end --> */
-                if (in_comment && i + 2 < line->len && 
-                    line->data[i] == '-' && line->data[i+1] == '-' && line->data[i+2] == '>') {
-                    in_comment = 0;
-                    i += 2;
-                    continue;
-                }
-                
-                /* Skip if in comment */
-                if (in_comment) continue;
-                
-                if (line->data[i] == '<' && i + 1 < line->len) {
-                    if (line->data[i+1] != '/' && line->data[i+1] != '!' && line->data[i+1] != '?') {
-                        /* Check for self-closing tag like <br/> or <img/> */
-                        int is_self_closing = 0;
-                        for (size_t j = i; j < line->len; j++) {
-                            if (line->data[j] == '/' && j + 1 < line->len && line->data[j+1] == '>') {
-                                is_self_closing = 1;
-                                break;
-                            }
-                            if (line->data[j] == '>') break;
-                        }
-                        if (!is_self_closing) {
-                            tag_depth++;
-                        }
-                    } else if (line->data[i+1] == '/') {
-                        /* Closing tag */
-                        tag_depth--;
-                        if (tag_depth < 0) {
-                            ed->syntax_error.line = line_num;
-                            ed->syntax_error.col_start = i;
-                            ed->syntax_error.col_end = i + 2;
-                            snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                                    "Extra closing tag - no opening tag");
-                            return;
-                        }
-                    }
-                }
+                cell = c;
             }
-            line = line->next;
-            line_num++;
-        }
-        if (tag_depth != 0) {
-            ed->syntax_error.line = line_num - 1;
-            ed->syntax_error.col_start = 0;
-            ed->syntax_error.col_end = 0;
-            snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                    "Unclosed tag - %d open tag(s)", tag_depth);
-            return;
+            rc->cells[i] = cell | attr;
         }
     }
     
-    /* Java/C/C++/Go validation */
-    if (strcmp(ext, ".java") == 0 || strcmp(ext, ".c") == 0 || 
-        strcmp(ext, ".cpp") == 0 || strcmp(ext, ".go") == 0 ||
-        strcmp(ext, ".h") == 0 || strcmp(ext, ".hpp") == 0) {
-        int brace_count = 0;
-        int in_string = 0, in_multiline_comment = 0;
-        line = ed->first_line;
-        line_num = 1;
-        while (line) {
-            for (size_t i = 0; i < line->len; i++) {
-                char c = line->data[i];
-                
-                /* Check for single-line comment */
-                if (!in_string && !in_multiline_comment && 
-                    c == '/' && i + 1 < line->len && line->data[i+1] == '/') {
-                    break;  /* Rest of line is comment */
-                }
-                
-                /* Check for multi-line comment start */
-                if (!in_string && !in_multiline_comment && 
-                    c == '/' && i + 1 < line->len && line->data[i+1] == '*') {
-                    in_multiline_comment = 1;
-                    i++;  /* Skip star */
-                    continue;
-                }
-                
-                /* Check for multi-line comment end */
-                if (in_multiline_comment && 
-                    c == '*' && i + 1 < line->len && line->data[i+1] == '/') {
-                    in_multiline_comment = 0;
-                    i++;  /* Skip slash */
-                    continue;
-                }
-                
-                /* Skip if in comment */
-                if (in_multiline_comment) continue;
-                
-                /* Check for strings */
-                if (c == '"' && (i == 0 || line->data[i-1] != '\\')) {
-                    in_string = !in_string;
-                    continue;
-                }
-                
-                /* Skip if in string */
-                if (in_string) continue;
-                
-                /* Check braces */
-                if (c == '{') {
-                    brace_count++;
-                } else if (c == '}') {
-                    brace_count--;
-                    if (brace_count < 0) {
-                        ed->syntax_error.line = line_num;
-                        ed->syntax_error.col_start = i;
-                        ed->syntax_error.col_end = i + 1;
-                        snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                                "Extra '}' - no opening brace");
-                        return;
-                    }
-                }
-            }
-            line = line->next;
-            line_num++;
-        }
-        if (brace_count != 0) {
-            ed->syntax_error.line = line_num - 1;
-            ed->syntax_error.col_start = 0;
-            ed->syntax_error.col_end = 0;
-            snprintf(ed->syntax_error.msg, sizeof(ed->syntax_error.msg), 
-                    "Unclosed '{' - %d open brace(s)", brace_count);
-            return;
-        }
-    }
-}
-
-/* Set message */
-void set_message(Editor *ed, const char *msg) {
-    strncpy(ed->message, msg, sizeof(ed->message) - 1);
-    ed->message_timeout = 4;  /* 4 frames ~= 200ms */
+    mvaddchnstr(row, LINE_NUMBER_WIDTH, rc->cells, len);
 }
 
-/* Draw screen */
+/* Draw screen - only text rows that changed since the last frame are redrawn */
 void draw_screen(Editor *ed) {
-    erase();
+    if (ed->offset_wrap >= line_rows(ed, ed->offset_y)) ed->offset_wrap = 0;
+    int top = visual_row(ed, ed->offset_y) + ed->offset_wrap;
+    render_prepare(ed, top);
     
-    /* Draw text area with word wrap */
+    /* Draw text area with word wrap, from the top line's offset_wrap-th row */
     int screen_row = 0;
-    Line *line = get_line_at(ed, ed->offset_y);
+    Line view = {0};
+    Line *line = &view;
     int line_num = ed->offset_y;
+    int first_wrap = ed->offset_wrap;
     
-    while (screen_row < ed->edit_height && line) {
+    while (screen_row < ed->edit_height && get_line_at(ed, line_num, line)) {
         /* Calculate wrapped lines */
         int line_len = line->len;
         int wraps = (line_len + ed->edit_width - 1) / ed->edit_width;
         if (wraps < 1) wraps = 1;
         
-        for (int wrap = 0; wrap < wraps && screen_row < ed->edit_height; wrap++) {
+        int sel_from, sel_to, err_from, err_to;
+        selection_span(ed, line_num, &sel_from, &sel_to);
+        error_span(ed, line_num, line_len, &err_from, &err_to);
+        
+        for (int wrap = first_wrap; wrap < wraps && screen_row < ed->edit_height; wrap++) {
+            int start = wrap * ed->edit_width;
+            int end = start + ed->edit_width;
+            if (end > line_len) end = line_len;
+            
+            /* Spans as seen by this row */
+            int attrs[6] = { line_num, wrap,
+                             sel_from > start ? sel_from - start : 0, sel_to < end ? sel_to - start : end - start,
+                             err_from > start ? err_from - start : 0, err_to < end ? err_to - start : end - start };
+            if (attrs[2] >= attrs[3]) attrs[2] = attrs[3] = -1;
+            if (attrs[4] >= attrs[5]) attrs[4] = attrs[5] = -1;
+            if (render_row_current(ed, screen_row, row_hash(attrs, 6, line->data + start, end - start))) {
+                screen_row++;
+                continue;
+            }
+            
             /* Line number (only on first wrap) */
             if (wrap == 0) {
                 attron(COLOR_PAIR(1) | A_BOLD);
@@ -742,90 +4807,21 @@ void draw_screen(Editor *ed) {
             }
             
             /* Text */
-            int start = wrap * ed->edit_width;
-            int end = start + ed->edit_width;
-            if (end > line_len) end = line_len;
-            
-            for (int i = start; i < end; i++) {
-                int is_selected = 0;
-                int is_error = 0;
-                
-                /* Check if this character is selected */
-                if (ed->sel_active) {
-                    int sy = ed->sel_start_y, sx = ed->sel_start_x;
-                    int ey = ed->sel_end_y, ex = ed->sel_end_x;
-                    
-                    /* Normalize selection */
-                    if (sy > ey || (sy == ey && sx > ex)) {
-                        int tmp;
-                        tmp = sy; sy = ey; ey = tmp;
-                        tmp = sx; sx = ex; ex = tmp;
-                    }
-                    
-                    if (line_num >= sy && line_num <= ey) {
-                        if (sy == ey) {
-                            is_selected = (i >= sx && i < ex);
-                        } else if (line_num == sy) {
-                            is_selected = (i >= sx);
-                        } else if (line_num == ey) {
-                            is_selected = (i < ex);
-                        } else {
-                            is_selected = 1;
-                        }
-                    }
-                }
-                
-                /* Check if this character is in error position */
-                if (ed->syntax_error.line > 0 && (line_num + 1) == ed->syntax_error.line) {
-                    if (ed->syntax_error.col_end > ed->syntax_error.col_start) {
-                        /* Specific position error */
-                        if (i >= ed->syntax_error.col_start && i < ed->syntax_error.col_end) {
-                            is_error = 1;
-                        }
-                    } else {
-                        /* Whole line error - highlight first 10 chars or whole line */
-                        if (i < 10 || i < (int)line->len) {
-                            is_error = 1;
-                        }
-                    }
-                }
-                
-                /* Apply highlighting */
-                if (is_error) {
-                    attron(COLOR_PAIR(3) | A_UNDERLINE);  /* Red underline */
-                } else if (is_selected) {
-                    attron(COLOR_PAIR(5));
-                }
-                
-                /* Display character - show TAB and space properly */
-                char display_char = line->data[i];
-                if (is_error) {
-                    /* For error display, show TAB as '^' and keep space visible */
-                    if (display_char == '\t') {
-                        mvaddch(screen_row, LINE_NUMBER_WIDTH + (i - start), '^' | A_UNDERLINE | COLOR_PAIR(3));
-                    } else if (display_char == ' ') {
-                        mvaddch(screen_row, LINE_NUMBER_WIDTH + (i - start), '_' | A_UNDERLINE | COLOR_PAIR(3));
-                    } else {
-                        mvaddch(screen_row, LINE_NUMBER_WIDTH + (i - start), display_char);
-                    }
-                } else {
-                    mvaddch(screen_row, LINE_NUMBER_WIDTH + (i - start), display_char);
-                }
-                
-                /* Remove highlighting */
-                if (is_error) {
-                    attroff(COLOR_PAIR(3) | A_UNDERLINE);
-                } else if (is_selected) {
-                    attroff(COLOR_PAIR(5));
-                }
-            }
+            render_text(ed, screen_row, line->data + start, end - start, attrs[2], attrs[3], attrs[4], attrs[5]);
             
             screen_row++;
         }
         
-        line = line->next;
         line_num++;
+        first_wrap = 0;
+    }
+    
+    /* Rows below the end of the document */
+    static const int blank[6] = { -1, 0, -1, -1, -1, -1 };
+    for (; screen_row < ed->edit_height; screen_row++) {
+        render_row_current(ed, screen_row, row_hash(blank, 6, "", 0));
     }
+    line_release(&view);
     
     /* Status bar */
     int status_line = ed->screen_height - 2;
@@ -841,20 +4837,36 @@ void draw_screen(Editor *ed) {
     mvprintw(status_line, 0, "%s", status_left);
     
     /* Detailed position info with percentage */
-    char status_center[80];
+    char status_center[128];
     int percent = (ed->total_lines > 0) ? ((ed->cursor_y + 1) * 100 / ed->total_lines) : 0;
-    snprintf(status_center, sizeof(status_center), "Line %d/%d (%d%%), Col %d ",
-             ed->cursor_y + 1, ed->total_lines, percent, ed->cursor_x + 1);
+    if (ed->load_pos < ed->load_end) {
+        snprintf(status_center, sizeof(status_center), "Line %d/%d+ (yuklanmoqda %d%%), Col %d ",
+                 ed->cursor_y + 1, ed->total_lines,
+                 (int)(ed->load_pos * 100 / ed->load_end), ed->cursor_x + 1);
+    } else {
+        snprintf(status_center, sizeof(status_center), "Line %d/%d (%d%%), Col %d ",
+                 ed->cursor_y + 1, ed->total_lines, percent, ed->cursor_x + 1);
+    }
+    int match_total;
+    int match = match_current(ed, &match_total);
+    if (match > 0) {
+        size_t used = strlen(status_center);
+        snprintf(status_center + used, sizeof(status_center) - used, "- match %d of %d ", match, match_total);
+    }
     int center_x = (ed->screen_width - strlen(status_center)) / 2;
     mvprintw(status_line, center_x, "%s", status_center);
     
-    /* Check syntax errors - display in center-right */
-    check_syntax_error(ed);
-    if (ed->syntax_error.line > 0) {
-        attron(COLOR_PAIR(3));  /* Red color */
+    /* Syntax errors from the last validation - display in center-right, marked while a newer one runs */
+    int checking = syntax_checking(ed);
+    if (ed->syntax_error.line > 0 || checking) {
+        if (!checking) attron(COLOR_PAIR(3));  /* Red color */
         char error_display[200];  /* Increased buffer size to avoid truncation warning */
-        snprintf(error_display, sizeof(error_display), "⚠ Q%d: %s", 
-                 ed->syntax_error.line, ed->syntax_error.msg);
+        if (ed->syntax_error.line > 0) {
+            snprintf(error_display, sizeof(error_display), "%s Q%d: %s", checking ? "checking…" : "⚠",
+                     ed->syntax_error.line, ed->syntax_error.msg);
+        } else {
+            snprintf(error_display, sizeof(error_display), "checking…");
+        }
         
         /* Truncate if too long */
         int max_len = ed->screen_width / 2 - 2;  /* Use half screen */
@@ -876,78 +4888,45 @@ void draw_screen(Editor *ed) {
             if (error_x < 0) error_x = 0;
         }
         mvprintw(status_line, error_x, "%s", error_display);
-        attroff(COLOR_PAIR(3));
+        if (!checking) attroff(COLOR_PAIR(3));
     }
     
     attroff(COLOR_PAIR(6) | A_BOLD);
     
     /* Help line */
     int help_line = ed->screen_height - 1;
-    if (ed->message_timeout > 0) {
+    if (ed->message_until > now_ms()) {
         mvprintw(help_line, 0, "%s", ed->message);
-        ed->message_timeout--;
     } else {
         mvprintw(help_line, 0, "^S:Save  ^Q:Quit  ^Z:Undo  ^F:Find  ^R:Replace  ^K:Cut  ^U:Paste  RClick:Paste");
     }
+    clrtoeol();
     
     /* Position cursor - with word wrap consideration */
-    int cursor_screen_y = 0;
-    Line *cline = ed->first_line;
-    for (int i = 0; i < ed->offset_y && cline; i++) {
-        cline = cline->next;
-    }
-    
-    for (int i = ed->offset_y; i < ed->cursor_y && cline; i++) {
-        int wraps = (cline->len + ed->edit_width - 1) / ed->edit_width;
-        if (wraps < 1) wraps = 1;
-        cursor_screen_y += wraps;
-        cline = cline->next;
-    }
-    
     int cursor_wrap = ed->cursor_x / ed->edit_width;
     int cursor_wrap_x = ed->cursor_x % ed->edit_width;
-    cursor_screen_y += cursor_wrap;
+    int cursor_screen_y = visual_row(ed, ed->cursor_y) + cursor_wrap - top;
     
-    if (cursor_screen_y < ed->edit_height) {
+    if (cursor_screen_y >= 0 && cursor_screen_y < ed->edit_height) {
         move(cursor_screen_y, LINE_NUMBER_WIDTH + cursor_wrap_x);
     }
     
     refresh();
 }
 
-/* Save state for undo */
+/*
+ * Save state for undo - the following edits go into a new step.  The
+ * step is opened by the first edit that is logged, so a command that
+ * ends up changing nothing leaves neither an empty step nor a dropped
+ * redo branch behind.
+ */
 void save_undo(Editor *ed) {
-    if (ed->undo_count >= MAX_UNDO) {
-        /* Free oldest undo */
-        for (int i = 0; i < ed->undo_stack[0].num_lines; i++) {
-            free(ed->undo_stack[0].lines[i]);
-        }
-        free(ed->undo_stack[0].lines);
-        
-        /* Shift stack */
-        for (int i = 0; i < MAX_UNDO - 1; i++) {
-            ed->undo_stack[i] = ed->undo_stack[i + 1];
-        }
-        ed->undo_count--;
-    }
-    
-    /* Save current state */
-    ed->undo_stack[ed->undo_count].num_lines = ed->total_lines;
-    ed->undo_stack[ed->undo_count].cursor_x = ed->cursor_x;
-    ed->undo_stack[ed->undo_count].cursor_y = ed->cursor_y;
-    ed->undo_stack[ed->undo_count].lines = malloc(sizeof(char*) * ed->total_lines);
-    
-    Line *line = ed->first_line;
-    for (int i = 0; i < ed->total_lines && line; i++) {
-        ed->undo_stack[ed->undo_count].lines[i] = strdup(line->data);
-        line = line->next;
-    }
-    
-    ed->undo_count++;
-    debug_log("Undo saved: %d states", ed->undo_count);
+    ed->undo_pending = 1;
+    ed->undo_pending_x = ed->cursor_x;
+    ed->undo_pending_y = ed->cursor_y;
 }
 
-/* Perform undo */
+/* Perform undo - replay the inverse of each logged edit, newest first */
 void perform_undo(Editor *ed) {
     if (ed->undo_count == 0) {
         set_message(ed, "Undo: Nothing to undo");
@@ -955,55 +4934,77 @@ void perform_undo(Editor *ed) {
         return;
     }
     
+    ed->undo_pending = 0;
     ed->undo_count--;
-    
-    /* Free current lines */
-    Line *line = ed->first_line;
-    while (line) {
-        Line *next = line->next;
-        free(line->data);
-        free(line);
-        line = next;
+    ed->redo_count++;
+    UndoGroup *group = history_at(ed, ed->undo_count);
+    group->redo_x = ed->cursor_x;
+    group->redo_y = ed->cursor_y;
+    
+    ed->undo_replaying = 1;
+    for (size_t i = group->num_ops; i-- > 0; ) {
+        UndoOp *op = &group->ops[i];
+        if (op->type == UNDO_INSERT) {
+            doc_unlog_insert(ed, group, op);
+        } else if (op->type == UNDO_REPLACE) {
+            doc_swap_pieces(ed, group, op);
+        } else {
+            doc_insert_pieces(ed, op->offset, op->pieces, op->num_pieces);
+        }
     }
+    ed->undo_replaying = 0;
     
-    /* Restore from undo stack */
-    ed->total_lines = ed->undo_stack[ed->undo_count].num_lines;
-    ed->cursor_x = ed->undo_stack[ed->undo_count].cursor_x;
-    ed->cursor_y = ed->undo_stack[ed->undo_count].cursor_y;
+    ed->cursor_x = group->cursor_x;
+    ed->cursor_y = group->cursor_y;
     ed->preferred_x = ed->cursor_x;
+    ed->modified = 1;
     
-    ed->first_line = NULL;
-    Line *last = NULL;
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Undo: %d ta orqaga", ed->undo_count);
+    set_message(ed, msg);
+    debug_log("Undo performed: now %d states", ed->undo_count);
+}
+
+/* Perform redo - replay the logged edits of the last undone step, oldest first */
+void perform_redo(Editor *ed) {
+    if (ed->redo_count == 0) {
+        set_message(ed, "Redo: Nothing to redo");
+        debug_log("Redo: empty branch");
+        return;
+    }
     
-    for (int i = 0; i < ed->total_lines; i++) {
-        Line *new_line = calloc(1, sizeof(Line));
-        new_line->data = strdup(ed->undo_stack[ed->undo_count].lines[i]);
-        new_line->len = strlen(new_line->data);
-        new_line->capacity = new_line->len + 128;
-        new_line->data = realloc(new_line->data, new_line->capacity);
-        
-        if (!ed->first_line) {
-            ed->first_line = new_line;
+    ed->undo_pending = 0;
+    UndoGroup *group = history_at(ed, ed->undo_count);
+    ed->undo_count++;
+    ed->redo_count--;
+    
+    ed->undo_replaying = 1;
+    for (size_t i = 0; i < group->num_ops; i++) {
+        UndoOp *op = &group->ops[i];
+        if (op->type == UNDO_INSERT) {
+            doc_insert_pieces(ed, op->offset, op->pieces, op->num_pieces);
+        } else if (op->type == UNDO_REPLACE) {
+            doc_swap_pieces(ed, group, op);
         } else {
-            last->next = new_line;
-            new_line->prev = last;
+            doc_delete(ed, op->offset, op->len);
         }
-        last = new_line;
     }
+    ed->undo_replaying = 0;
     
-    ed->current_line = get_line_at(ed, ed->cursor_y);
+    ed->cursor_x = group->redo_x;
+    ed->cursor_y = group->redo_y;
+    ed->preferred_x = ed->cursor_x;
+    ed->sel_active = 0;
     ed->modified = 1;
     
     char msg[64];
-    snprintf(msg, sizeof(msg), "Undo: %d ta orqaga", ed->undo_count);
+    snprintf(msg, sizeof(msg), "Redo: %d ta oldinga", ed->redo_count);
     set_message(ed, msg);
-    debug_log("Undo performed: now %d states", ed->undo_count);
+    debug_log("Redo performed: %d left", ed->redo_count);
 }
 
 /* Insert character */
 void insert_char(Editor *ed, char c) {
-    Line *line = ed->current_line;
-    
     /* Save undo only at word boundaries */
     static int last_was_space = 1;
     if (last_was_space || ed->undo_count == 0) {
@@ -1014,31 +5015,18 @@ void insert_char(Editor *ed, char c) {
         last_was_space = 1;
     }
     
-    /* Expand buffer if needed */
-    if (line->len + 2 >= line->capacity) {
-        line->capacity *= 2;
-        line->data = realloc(line->data, line->capacity);
-    }
-    
     /* Delete selection first if active */
     if (ed->sel_active) {
         delete_selection(ed);
-        line = ed->current_line;
     }
     
     /* Insert character */
-    memmove(&line->data[ed->cursor_x + 1], &line->data[ed->cursor_x], 
-            line->len - ed->cursor_x + 1);
-    line->data[ed->cursor_x] = c;
-    line->len++;
+    doc_insert(ed, line_offset(ed, ed->cursor_y) + ed->cursor_x, &c, 1);
     ed->cursor_x++;
     ed->preferred_x = ed->cursor_x;
     ed->modified = 1;
     
     ed->sel_active = 0;
-    
-    /* Re-check syntax immediately */
-    check_syntax_error(ed);
 }
 
 /* Handle tab */
@@ -1064,46 +5052,21 @@ void backspace_char(Editor *ed) {
     }
     
     if (ed->cursor_x > 0) {
-        Line *line = ed->current_line;
-        memmove(&line->data[ed->cursor_x - 1], &line->data[ed->cursor_x],
-                line->len - ed->cursor_x + 1);
-        line->len--;
+        doc_delete(ed, line_offset(ed, ed->cursor_y) + ed->cursor_x - 1, 1);
         ed->cursor_x--;
         ed->preferred_x = ed->cursor_x;
         ed->modified = 1;
     } else if (ed->cursor_y > 0) {
-        /* Merge with previous line */
-        Line *prev = ed->current_line->prev;
-        int prev_len = prev->len;
-        
-        /* Expand previous line buffer */
-        while (prev->len + ed->current_line->len + 1 >= prev->capacity) {
-            prev->capacity *= 2;
-            prev->data = realloc(prev->data, prev->capacity);
-        }
-        
-        strcat(prev->data, ed->current_line->data);
-        prev->len += ed->current_line->len;
+        /* Merge with previous line - drop the line terminator between them */
+        int prev_len = line_length(ed, ed->cursor_y - 1);
+        size_t prev_end = line_offset(ed, ed->cursor_y - 1) + prev_len;
+        doc_delete(ed, prev_end, line_offset(ed, ed->cursor_y) - prev_end);
         
-        /* Remove current line */
-        if (ed->current_line->next) {
-            ed->current_line->next->prev = prev;
-        }
-        prev->next = ed->current_line->next;
-        
-        free(ed->current_line->data);
-        free(ed->current_line);
-        
-        ed->current_line = prev;
         ed->cursor_y--;
         ed->cursor_x = prev_len;
         ed->preferred_x = ed->cursor_x;
-        ed->total_lines--;
         ed->modified = 1;
     }
-    
-    /* Re-check syntax immediately */
-    check_syntax_error(ed);
 }
 
 /* Delete character */
@@ -1115,38 +5078,16 @@ void delete_char(Editor *ed) {
         return;
     }
     
-    Line *line = ed->current_line;
+    size_t offset = line_offset(ed, ed->cursor_y) + ed->cursor_x;
     
-    if (ed->cursor_x < line->len) {
-        memmove(&line->data[ed->cursor_x], &line->data[ed->cursor_x + 1],
-                line->len - ed->cursor_x);
-        line->len--;
+    if (ed->cursor_x < line_length(ed, ed->cursor_y)) {
+        doc_delete(ed, offset, 1);
         ed->modified = 1;
-    } else if (line->next) {
-        /* Merge with next line */
-        Line *next = line->next;
-        
-        while (line->len + next->len + 1 >= line->capacity) {
-            line->capacity *= 2;
-            line->data = realloc(line->data, line->capacity);
-        }
-        
-        strcat(line->data, next->data);
-        line->len += next->len;
-        
-        line->next = next->next;
-        if (next->next) {
-            next->next->prev = line;
-        }
-        
-        free(next->data);
-        free(next);
-        ed->total_lines--;
+    } else if (ed->cursor_y < ed->total_lines - 1) {
+        /* Merge with next line - drop the line terminator at the cursor */
+        doc_delete(ed, offset, line_offset(ed, ed->cursor_y + 1) - offset);
         ed->modified = 1;
     }
-    
-    /* Re-check syntax immediately */
-    check_syntax_error(ed);
 }
 
 /* Insert newline */
@@ -1157,51 +5098,29 @@ void insert_newline(Editor *ed) {
         delete_selection(ed);
     }
     
-    Line *line = ed->current_line;
-    Line *new_line = calloc(1, sizeof(Line));
-    new_line->capacity = 128;
-    new_line->data = malloc(new_line->capacity);
-    
     /* Split line at cursor */
-    strcpy(new_line->data, &line->data[ed->cursor_x]);
-    new_line->len = line->len - ed->cursor_x;
-    line->data[ed->cursor_x] = '\0';
-    line->len = ed->cursor_x;
+    const char *eol = ed->eol ? ed->eol : "\n";
+    doc_insert(ed, line_offset(ed, ed->cursor_y) + ed->cursor_x, eol, strlen(eol));
     
-    /* Insert new line */
-    new_line->next = line->next;
-    new_line->prev = line;
-    if (line->next) {
-        line->next->prev = new_line;
-    }
-    line->next = new_line;
-    
-    ed->current_line = new_line;
     ed->cursor_y++;
     ed->cursor_x = 0;
     ed->preferred_x = 0;
-    ed->total_lines++;
     ed->modified = 1;
-    
-    /* Re-check syntax immediately */
-    check_syntax_error(ed);
 }
 
 /* Move cursor */
 void move_cursor(Editor *ed, int dy, int dx) {
     if (dy < 0 && ed->cursor_y > 0) {
-        ed->current_line = ed->current_line->prev;
         ed->cursor_y--;
         ed->cursor_x = ed->preferred_x;
-        if (ed->cursor_x > ed->current_line->len) {
-            ed->cursor_x = ed->current_line->len;
+        if (ed->cursor_x > line_length(ed, ed->cursor_y)) {
+            ed->cursor_x = line_length(ed, ed->cursor_y);
         }
-    } else if (dy > 0 && ed->current_line->next) {
-        ed->current_line = ed->current_line->next;
+    } else if (dy > 0 && ed->cursor_y < ed->total_lines - 1) {
         ed->cursor_y++;
         ed->cursor_x = ed->preferred_x;
-        if (ed->cursor_x > ed->current_line->len) {
-            ed->cursor_x = ed->current_line->len;
+        if (ed->cursor_x > line_length(ed, ed->cursor_y)) {
+            ed->cursor_x = line_length(ed, ed->cursor_y);
         }
     }
     
@@ -1209,91 +5128,69 @@ void move_cursor(Editor *ed, int dy, int dx) {
         ed->cursor_x--;
         ed->preferred_x = ed->cursor_x;
     } else if (dx < 0 && ed->cursor_y > 0) {
-        ed->current_line = ed->current_line->prev;
         ed->cursor_y--;
-        ed->cursor_x = ed->current_line->len;
+        ed->cursor_x = line_length(ed, ed->cursor_y);
         ed->preferred_x = ed->cursor_x;
     }
     
-    if (dx > 0 && ed->cursor_x < ed->current_line->len) {
+    if (dx > 0 && ed->cursor_x < line_length(ed, ed->cursor_y)) {
         ed->cursor_x++;
         ed->preferred_x = ed->cursor_x;
-    } else if (dx > 0 && ed->current_line->next) {
-        ed->current_line = ed->current_line->next;
+    } else if (dx > 0 && ed->cursor_y < ed->total_lines - 1) {
         ed->cursor_y++;
         ed->cursor_x = 0;
         ed->preferred_x = 0;
     }
     
-    /* Adjust scroll */
-    if (ed->cursor_y < ed->offset_y) {
-        ed->offset_y = ed->cursor_y;
-    }
-    while (ed->cursor_y - ed->offset_y >= ed->edit_height) {
-        ed->offset_y++;
-    }
-    
+    scroll_to_cursor(ed);
     ed->sel_active = 0;
 }
 
 /* Page Up */
 void page_up(Editor *ed) {
-    int move = ed->edit_height;
-    for (int i = 0; i < move && ed->cursor_y > 0; i++) {
-        if (ed->current_line->prev) {
-            ed->current_line = ed->current_line->prev;
-            ed->cursor_y--;
-        }
-    }
-    
-    /* Adjust scroll to keep cursor in view */
-    if (ed->cursor_y < ed->offset_y) {
-        ed->offset_y = ed->cursor_y;
-    }
+    /* Move a screen of rows, so wrapped lines count for what they take */
+    int wrap;
+    int row = visual_row(ed, ed->cursor_y) + ed->cursor_x / ed->edit_width - ed->edit_height;
+    ed->cursor_y = visual_line_at(ed, row, &wrap);
     
     /* Keep cursor_x within line bounds */
     ed->cursor_x = ed->preferred_x;
-    if (ed->cursor_x > ed->current_line->len) {
-        ed->cursor_x = ed->current_line->len;
+    if (ed->cursor_x > line_length(ed, ed->cursor_y)) {
+        ed->cursor_x = line_length(ed, ed->cursor_y);
     }
+    
+    /* Adjust scroll to keep cursor in view */
+    scroll_to_cursor(ed);
     ed->sel_active = 0;
 }
 
 /* Page Down */
 void page_down(Editor *ed) {
-    int move = ed->edit_height;
-    for (int i = 0; i < move && ed->current_line->next; i++) {
-        ed->current_line = ed->current_line->next;
-        ed->cursor_y++;
-    }
-    
-    /* Adjust scroll to keep cursor in view */
-    while (ed->cursor_y - ed->offset_y >= ed->edit_height) {
-        ed->offset_y++;
-    }
+    /* Move a screen of rows, so wrapped lines count for what they take */
+    int wrap;
+    int row = visual_row(ed, ed->cursor_y) + ed->cursor_x / ed->edit_width + ed->edit_height;
+    ed->cursor_y = visual_line_at(ed, row, &wrap);
     
     /* Keep cursor_x within line bounds */
     ed->cursor_x = ed->preferred_x;
-    if (ed->cursor_x > ed->current_line->len) {
-        ed->cursor_x = ed->current_line->len;
+    if (ed->cursor_x > line_length(ed, ed->cursor_y)) {
+        ed->cursor_x = line_length(ed, ed->cursor_y);
     }
+    
+    /* Adjust scroll to keep cursor in view */
+    scroll_to_cursor(ed);
     ed->sel_active = 0;
 }
 
 /* Select all */
 void select_all(Editor *ed) {
+    load_finish(ed);
     ed->sel_active = 1;
     ed->sel_start_y = 0;
     ed->sel_start_x = 0;
     
-    Line *last = ed->first_line;
-    int last_y = 0;
-    while (last->next) {
-        last = last->next;
-        last_y++;
-    }
-    ed->sel_end_y = last_y;
-    ed->sel_end_x = last->len;
+    ed->sel_end_y = ed->total_lines - 1;
+    ed->sel_end_x = line_length(ed, ed->sel_end_y);
     
     set_message(ed, "All selected");
 }
@@ -1312,51 +5209,16 @@ void delete_selection(Editor *ed) {
         tmp = sx; sx = ex; ex = tmp;
     }
     
-    Line *start_line = get_line_at(ed, sy);
-    Line *end_line = get_line_at(ed, ey);
-    
-    if (sy == ey) {
-        /* Single line */
-        memmove(&start_line->data[sx], &start_line->data[ex],
-                start_line->len - ex + 1);
-        start_line->len -= (ex - sx);
-    } else {
-        /* Multiple lines */
-        start_line->data[sx] = '\0';
-        start_line->len = sx;
-        
-        while (start_line->len + strlen(&end_line->data[ex]) + 1 >= start_line->capacity) {
-            start_line->capacity *= 2;
-            start_line->data = realloc(start_line->data, start_line->capacity);
-        }
-        strcat(start_line->data, &end_line->data[ex]);
-        start_line->len += strlen(&end_line->data[ex]);
-        
-        /* Delete intermediate lines */
-        Line *temp = start_line->next;
-        while (temp && temp != end_line->next) {
-            Line *next = temp->next;
-            free(temp->data);
-            free(temp);
-            temp = next;
-            ed->total_lines--;
-        }
-        
-        start_line->next = end_line->next;
-        if (end_line->next) {
-            end_line->next->prev = start_line;
-        }
-    }
+    /* One contiguous byte range, whether it spans lines or not */
+    size_t start = line_offset(ed, sy) + sx;
+    size_t end = line_offset(ed, ey) + ex;
+    doc_delete(ed, start, end - start);
     
-    ed->current_line = start_line;
     ed->cursor_y = sy;
     ed->cursor_x = sx;
     ed->preferred_x = sx;
     ed->sel_active = 0;
     ed->modified = 1;
-    
-    /* Re-check syntax immediately */
-    check_syntax_error(ed);
 }
 
 /* Copy selection */
@@ -1385,29 +5247,106 @@ void copy_selection(Editor *ed) {
     ed->clipboard_lines = ey - sy + 1;
     ed->clipboard = malloc(sizeof(char*) * ed->clipboard_lines);
     
-    Line *line = get_line_at(ed, sy);
-    for (int i = 0; i < ed->clipboard_lines && line; i++) {
+    Line line = {0};
+    for (int i = 0; i < ed->clipboard_lines && get_line_at(ed, sy + i, &line); i++) {
         if (sy == ey) {
-            ed->clipboard[i] = safe_strndup(&line->data[sx], ex - sx);
+            ed->clipboard[i] = safe_strndup(&line.data[sx], ex - sx);
         } else if (i == 0) {
-            ed->clipboard[i] = strdup(&line->data[sx]);
+            ed->clipboard[i] = safe_strndup(&line.data[sx], line.len - sx);
         } else if (i == ed->clipboard_lines - 1) {
-            ed->clipboard[i] = safe_strndup(line->data, ex);
+            ed->clipboard[i] = safe_strndup(line.data, ex);
+        } else {
+            ed->clipboard[i] = safe_strndup(line.data, line.len);
+        }
+    }
+    line_release(&line);
+    
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Nusxalandi: %d qator", ed->clipboard_lines);
+    set_message(ed, msg);
+}
+
+/* Cut selection */
+void cut_selection(Editor *ed) {
+    copy_selection(ed);
+    delete_selection(ed);
+}
+
+/* Insert text at the cursor as a single edit and leave the cursor after it */
+void insert_text(Editor *ed, const char *text, size_t len) {
+    size_t end = line_offset(ed, ed->cursor_y) + ed->cursor_x + len;
+    doc_insert(ed, end - len, text, len);
+    ed->cursor_y = line_at_offset(ed, end);
+    ed->cursor_x = end - line_offset(ed, ed->cursor_y);
+    ed->preferred_x = ed->cursor_x;
+    ed->modified = 1;
+}
+
+/*
+ * Insert lines at the cursor, joined by the document's line ending, as a
+ * single edit - one copy into the add buffer, one piece, one undo op
+ */
+void insert_lines(Editor *ed, char **lines, int count) {
+    const char *eol = ed->eol ? ed->eol : "\n";
+    size_t eol_len = strlen(eol), total = 0;
+    for (int i = 0; i < count; i++) {
+        total += strlen(lines[i]) + (i > 0 ? eol_len : 0);
+    }
+    
+    char *text = malloc(total + 1);
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            memcpy(text + len, eol, eol_len);
+            len += eol_len;
+        }
+        size_t n = strlen(lines[i]);
+        memcpy(text + len, lines[i], n);
+        len += n;
+    }
+    insert_text(ed, text, len);
+    free(text);
+}
+
+/*
+ * Bracketed paste: take the keys up to the end marker as text - tabs and
+ * all bytes as they are, line breaks in the document's style - and
+ * insert it in one undo step
+ */
+void paste_terminal(Editor *ed) {
+    const char *eol = ed->eol ? ed->eol : "\n";
+    size_t eol_len = strlen(eol), len = 0, cap = 4096;
+    char *text = malloc(cap);
+    
+    timeout(PASTE_TIMEOUT_MS);
+    int ch, prev = 0;
+    while ((ch = getch()) != ERR && ch != KEY_PASTE_END) {
+        if (ch > 255 && ch != KEY_ENTER) continue;
+        if (len + eol_len + 1 > cap) {
+            cap *= 2;
+            text = realloc(text, cap);
+        }
+        if (ch == '\n' && prev == '\r') {
+            /* The '\r' already stood for this line break */
+        } else if (ch == '\r' || ch == '\n' || ch == KEY_ENTER) {
+            memcpy(text + len, eol, eol_len);
+            len += eol_len;
         } else {
-            ed->clipboard[i] = strdup(line->data);
+            text[len++] = (char)ch;
         }
-        line = line->next;
+        prev = ch;
     }
+    timeout(-1);
+    debug_log("paste_terminal: %zu bytes%s", len, ch == ERR ? ", no end marker" : "");
     
-    char msg[64];
-    snprintf(msg, sizeof(msg), "Nusxalandi: %d qator", ed->clipboard_lines);
-    set_message(ed, msg);
-}
-
-/* Cut selection */
-void cut_selection(Editor *ed) {
-    copy_selection(ed);
-    delete_selection(ed);
+    if (len > 0) {
+        save_undo(ed);
+        if (ed->sel_active) {
+            delete_selection(ed);
+        }
+        insert_text(ed, text, len);
+    }
+    free(text);
 }
 
 /* Paste clipboard */
@@ -1417,73 +5356,35 @@ void paste_clipboard(Editor *ed) {
         return;
     }
     
+    save_undo(ed);
     if (ed->sel_active) {
         delete_selection(ed);
     }
-    
-    Line *line = ed->current_line;
-    
-    if (ed->clipboard_lines == 1) {
-        /* Single line paste */
-        size_t paste_len = strlen(ed->clipboard[0]);
-        while (line->len + paste_len + 1 >= line->capacity) {
-            line->capacity *= 2;
-            line->data = realloc(line->data, line->capacity);
-        }
-        
-        memmove(&line->data[ed->cursor_x + paste_len], &line->data[ed->cursor_x],
-                line->len - ed->cursor_x + 1);
-        memcpy(&line->data[ed->cursor_x], ed->clipboard[0], paste_len);
-        line->len += paste_len;
-        ed->cursor_x += paste_len;
-        ed->preferred_x = ed->cursor_x;
-    } else {
-        /* Multi-line paste - implementation similar to single line */
-        /* For brevity, simplified version */
-        for (int i = 0; i < ed->clipboard_lines; i++) {
-            if (i > 0) insert_newline(ed);
-            for (char *p = ed->clipboard[i]; *p; p++) {
-                insert_char(ed, *p);
-            }
-        }
-    }
-    
-    ed->modified = 1;
-    
-    /* Re-check syntax immediately */
-    check_syntax_error(ed);
+    insert_lines(ed, ed->clipboard, ed->clipboard_lines);
     
     set_message(ed, "Pasted");
 }
 
 /* Cut line (Nano-style Ctrl+K) */
 void cut_line(Editor *ed) {
-    Line *line = ed->current_line;
+    save_undo(ed);
+    Line line = {0};
+    get_line_at(ed, ed->cursor_y, &line);
+    size_t start = line_offset(ed, ed->cursor_y);
     
     /* Add to cut buffer */
     ed->cut_buffer = realloc(ed->cut_buffer, sizeof(char*) * (ed->cut_buffer_lines + 1));
-    ed->cut_buffer[ed->cut_buffer_lines] = strdup(&line->data[ed->cursor_x]);
+    ed->cut_buffer[ed->cut_buffer_lines] = safe_strndup(&line.data[ed->cursor_x],
+                                                        line.len - ed->cursor_x);
     ed->cut_buffer_lines++;
     
     /* Cut from cursor to end of line */
-    line->data[ed->cursor_x] = '\0';
-    line->len = ed->cursor_x;
+    doc_delete(ed, start + ed->cursor_x, line.len - ed->cursor_x);
+    line_release(&line);
     
     /* If line is empty, delete it */
-    if (line->len == 0 && line->next) {
-        Line *next = line->next;
-        if (line->prev) {
-            line->prev->next = next;
-            next->prev = line->prev;
-            ed->current_line = line->prev;
-        } else {
-            ed->first_line = next;
-            next->prev = NULL;
-            ed->current_line = next;
-        }
-        free(line->data);
-        free(line);
-        ed->total_lines--;
+    if (ed->cursor_x == 0 && ed->cursor_y < ed->total_lines - 1) {
+        doc_delete(ed, start, line_offset(ed, ed->cursor_y + 1) - start);
         ed->cursor_x = 0;
         ed->cursor_y = (ed->cursor_y > 0) ? ed->cursor_y - 1 : 0;
     }
@@ -1500,14 +5401,8 @@ void uncut_text(Editor *ed) {
         return;
     }
     
-    for (int i = 0; i < ed->cut_buffer_lines; i++) {
-        for (char *p = ed->cut_buffer[i]; *p; p++) {
-            insert_char(ed, *p);
-        }
-        if (i < ed->cut_buffer_lines - 1) {
-            insert_newline(ed);
-        }
-    }
+    save_undo(ed);
+    insert_lines(ed, ed->cut_buffer, ed->cut_buffer_lines);
     
     /* Clear cut buffer */
     for (int i = 0; i < ed->cut_buffer_lines; i++) {
@@ -1537,7 +5432,6 @@ void handle_input(Editor *ed, int ch) {
                 draw_screen(ed);
                 timeout(-1);
                 int ch2 = getch();
-                timeout(50);
                 if (ch2 == 17) {
                     cleanup_editor(ed);
                     endwin();
@@ -1584,14 +5478,22 @@ void handle_input(Editor *ed, int ch) {
             search_text(ed);
             break;
             
+        case KEY_F(3): /* F3 - Next match */
+            search_next(ed, 1);
+            break;
+            
+        case KEY_F(15): /* Shift+F3 - Previous match */
+            search_next(ed, -1);
+            break;
+            
         case 18: /* Ctrl+R - Replace */
             debug_log("ACTION: Ctrl+R - replace");
             replace_text(ed);
             break;
             
         case 25: /* Ctrl+Y - Redo */
-            debug_log("ACTION: Ctrl+Y - redo (not implemented)");
-            set_message(ed, "Redo: Coming soon");
+            debug_log("ACTION: Ctrl+Y - perform_redo()");
+            perform_redo(ed);
             break;
             
         case KEY_BACKSPACE:
@@ -1641,7 +5543,7 @@ void handle_input(Editor *ed, int ch) {
             break;
             
         case KEY_END:
-            ed->cursor_x = ed->current_line->len;
+            ed->cursor_x = line_length(ed, ed->cursor_y);
             ed->preferred_x = ed->cursor_x;
             ed->sel_active = 0;
             break;
@@ -1658,6 +5560,10 @@ void handle_input(Editor *ed, int ch) {
             handle_mouse(ed);
             break;
             
+        case KEY_PASTE_START:
+            paste_terminal(ed);
+            break;
+            
         default:
             if (ch >= 32 && ch < 127) {
                 insert_char(ed, (char)ch);
@@ -1680,20 +5586,15 @@ void handle_mouse(Editor *ed) {
                 int target_line = ed->syntax_error.line - 1;  /* Convert to 0-based */
                 if (target_line >= 0 && target_line < ed->total_lines) {
                     ed->cursor_y = target_line;
-                    ed->current_line = get_line_at(ed, target_line);
                     ed->cursor_x = ed->syntax_error.col_start;
                     if (ed->cursor_x < 0) ed->cursor_x = 0;
-                    if (ed->current_line && (size_t)ed->cursor_x > ed->current_line->len) {
-                        ed->cursor_x = ed->current_line->len;
+                    if ((size_t)ed->cursor_x > line_length(ed, target_line)) {
+                        ed->cursor_x = line_length(ed, target_line);
                     }
                     ed->preferred_x = ed->cursor_x;
                     
                     /* Adjust scroll if needed */
-                    if (ed->cursor_y < ed->offset_y) {
-                        ed->offset_y = ed->cursor_y;
-                    } else if (ed->cursor_y >= ed->offset_y + ed->edit_height) {
-                        ed->offset_y = ed->cursor_y - ed->edit_height + 1;
-                    }
+                    scroll_to_cursor(ed);
                     
                     debug_log("MOUSE: clicked error status, jumped to line %d", ed->syntax_error.line);
                     set_message(ed, "Jumped to error line");
@@ -1703,8 +5604,9 @@ void handle_mouse(Editor *ed) {
         }
         
         if (event.y < ed->edit_height && event.x >= LINE_NUMBER_WIDTH) {
-            int line_num = ed->offset_y + event.y;
-            int col = event.x - LINE_NUMBER_WIDTH;
+            int wrap;
+            int line_num = visual_line_at(ed, visual_row(ed, ed->offset_y) + ed->offset_wrap + event.y, &wrap);
+            int col = wrap * ed->edit_width + event.x - LINE_NUMBER_WIDTH;
             
             if (line_num >= ed->total_lines) {
                 line_num = ed->total_lines - 1;
@@ -1714,14 +5616,13 @@ void handle_mouse(Editor *ed) {
             /* Handle right-click paste */
             if (event.bstate & BUTTON3_PRESSED) {
                 /* Right click - paste at cursor position */
-                Line *target = get_line_at(ed, line_num);
-                if (target) {
-                    ed->current_line = target;
+                if (line_num < ed->total_lines) {
+                    size_t target_len = line_length(ed, line_num);
                     ed->cursor_y = line_num;
                     
                     /* Adjust column */
-                    if ((size_t)col > target->len) {
-                        col = (int)target->len;
+                    if ((size_t)col > target_len) {
+                        col = (int)target_len;
                     }
                     if (col < 0) col = 0;
                     
@@ -1738,14 +5639,13 @@ void handle_mouse(Editor *ed) {
             /* Handle button events */
             if (event.bstate & BUTTON1_PRESSED) {
                 /* Click - set cursor position and start selection */
-                Line *target = get_line_at(ed, line_num);
-                if (target) {
-                    ed->current_line = target;
+                if (line_num < ed->total_lines) {
+                    size_t target_len = line_length(ed, line_num);
                     ed->cursor_y = line_num;
                     
                     /* Adjust column for line length */
-                    if ((size_t)col > target->len) {
-                        col = (int)target->len;
+                    if ((size_t)col > target_len) {
+                        col = (int)target_len;
                     }
                     if (col < 0) col = 0;
                     
@@ -1763,11 +5663,11 @@ void handle_mouse(Editor *ed) {
             } else if (event.bstate & BUTTON1_RELEASED) {
                 /* Release - finalize selection */
                 if (ed->mouse_pressed) {
-                    Line *target = get_line_at(ed, line_num);
-                    if (target) {
+                    if (line_num < ed->total_lines) {
+                        size_t target_len = line_length(ed, line_num);
                         /* Adjust column for line length */
-                        if ((size_t)col > target->len) {
-                            col = (int)target->len;
+                        if ((size_t)col > target_len) {
+                            col = (int)target_len;
                         }
                         if (col < 0) col = 0;
                         
@@ -1797,11 +5697,11 @@ void handle_mouse(Editor *ed) {
                 }
             } else if ((event.bstate & REPORT_MOUSE_POSITION) && ed->mouse_pressed) {
                 /* Dragging - update selection only, NOT cursor */
-                Line *target = get_line_at(ed, line_num);
-                if (target) {
+                if (line_num < ed->total_lines) {
+                    size_t target_len = line_length(ed, line_num);
                     /* Adjust column for line length */
-                    if ((size_t)col > target->len) {
-                        col = (int)target->len;
+                    if ((size_t)col > target_len) {
+                        col = (int)target_len;
                     }
                     if (col < 0) col = 0;
                     
@@ -1818,158 +5718,288 @@ void handle_mouse(Editor *ed) {
     }
 }
 
+/*
+ * As-you-type search keeps one result set per query length.  A longer
+ * query narrows the set of the one before it (each of its hits followed
+ * by the new character) and carries on scanning where that one stopped;
+ * backspace drops back to the cached set below.  Scans go forward from
+ * the cursor and wrap, so the first hit is the nearest one, and advance a
+ * chunk at a time between keys so a stale query is simply abandoned.
+ */
+
+/* Drop a result set */
+static void search_level_free(SearchLevel *lv) {
+    finder_free(&lv->finder);
+    free(lv->hits);
+    memset(lv, 0, sizeof(SearchLevel));
+}
+
+/* Start the result set for query[0, len) - from the longest shorter one that is complete so far */
+static void search_level_init(SearchLevel *levels, int len, const char *query, size_t origin, int regex) {
+    SearchLevel *lv = &levels[len];
+    memset(lv, 0, sizeof(SearchLevel));
+    if (regex) {
+        /* A longer pattern need not match within a shorter one's matches - scan afresh */
+        lv->pos = origin;
+        finder_init_regex(&lv->finder, query, len, &lv->error);
+        return;
+    }
+    finder_init(&lv->finder, query, len);
+    
+    int base = len - 1;
+    while (base > 0 && levels[base].narrowing) base--;
+    if (base > 0 && !levels[base].overflow) {
+        lv->base = base;
+        lv->narrowing = 1;
+        lv->phase = levels[base].phase;
+        lv->pos = levels[base].pos;
+    } else {
+        lv->pos = origin;
+    }
+}
+
+static void search_level_add(SearchLevel *lv, size_t at) {
+    lv->count++;
+    if (lv->overflow) return;
+    if (lv->num_hits == SEARCH_MAX_HITS) {
+        lv->overflow = 1;  /* Longer queries scan afresh instead of narrowing */
+        return;
+    }
+    if (lv->num_hits == lv->hits_cap) {
+        lv->hits_cap = lv->hits_cap ? lv->hits_cap * 2 : 64;
+        lv->hits = realloc(lv->hits, sizeof(size_t) * lv->hits_cap);
+    }
+    lv->hits[lv->num_hits++] = at;
+}
+
+/* One chunk of work on query[0, len): narrow, load or scan.  Returns 1 while work remains. */
+static int search_level_step(Editor *ed, SearchLevel *levels, int len, size_t origin) {
+    SearchLevel *lv = &levels[len];
+    if (lv->error) return 0;
+    if (lv->narrowing) {
+        /* Keep the shorter query's hits that go on with the new characters */
+        SearchLevel *parent = &levels[lv->base];
+        size_t total = doc_length(ed);
+        size_t end = (parent->num_hits - lv->filtered > SEARCH_CHUNK_HITS) ? lv->filtered + SEARCH_CHUNK_HITS : parent->num_hits;
+        for (; lv->filtered < end; lv->filtered++) {
+            size_t at = parent->hits[lv->filtered];
+            int k = lv->base;
+            while (k < len && at + k < total && doc_byte(ed, at + k) == lv->finder.needle[k]) k++;
+            if (k == len) search_level_add(lv, at);
+        }
+        if (lv->filtered == parent->num_hits) lv->narrowing = 0;
+        return 1;
+    }
+    
+    /* Forward from the origin to the end, then from the top up to the origin */
+    size_t total = doc_length(ed);
+    if (lv->phase == 0 && lv->pos >= total && ed->load_pos < ed->load_end) {
+        if (!load_more(ed, LOAD_CHUNK_SIZE)) ed->syntax.due_ms = now_ms();
+        return 1;
+    }
+    if (lv->phase == 2) return 0;
+    size_t end = (lv->phase == 0) ? total : (origin < total ? origin : total);
+    size_t chunk_end = (end - lv->pos > SEARCH_CHUNK_SIZE) ? lv->pos + SEARCH_CHUNK_SIZE : end;
+    size_t to = (total - chunk_end >= (size_t)len - 1) ? chunk_end + len - 1 : total;
+    if (lv->finder.re) to = line_offset(ed, line_at_offset(ed, chunk_end) + 1);  /* Regex matches end by the line end */
+    size_t at, from = lv->pos;
+    while (from < chunk_end && doc_find(ed, &lv->finder, from, to, &at) && at < chunk_end) {
+        search_level_add(lv, at);
+        from = finder_resume(&lv->finder, at);
+    }
+    lv->pos = (from > chunk_end) ? from : chunk_end;
+    if (lv->pos >= end && (lv->phase == 1 || ed->load_pos >= ed->load_end)) {
+        lv->phase++;
+        lv->pos = 0;
+    }
+    return lv->phase < 2;
+}
+
+/* Search prompt with the live match count */
+static void search_prompt(Editor *ed, const char *query, const SearchLevel *lv, int busy, int regex) {
+    mvprintw(ed->screen_height - 1, 0, "^F %s  ^C Bekor: %s", regex ? "Regex" : "Qidirish", query);
+    int x = getcurx(stdscr);
+    clrtoeol();
+    if (lv && lv->error) {
+        printw("   [%s]", lv->error);
+    } else if (lv) {
+        printw("   [%zu%s ta]", lv->count, busy ? "+" : "");
+    }
+    move(ed->screen_height - 1, x);
+    refresh();
+}
+
+/* Put the cursor and selection on a match at offset */
+static void search_show(Editor *ed, size_t at, size_t len) {
+    int y = line_at_offset(ed, at);
+    ed->cursor_y = y;
+    ed->cursor_x = at - line_offset(ed, y);
+    ed->preferred_x = ed->cursor_x;
+    ed->sel_start_y = y;
+    ed->sel_start_x = ed->cursor_x;
+    ed->sel_end_y = y;
+    ed->sel_end_x = ed->cursor_x + len;
+    ed->sel_active = 1;
+}
+
 /* Search text */
 void search_text(Editor *ed) {
     debug_log("search_text: starting");
+    match_stop(ed);
     
     /* Input mode - NO echo to prevent backspace artifacts */
     curs_set(2);
     
     char query[256] = {0};
     int input_pos = 0;
+    int regex = 0;  /* Tab switches between text and regex */
     int ch;
     
-    /* Show initial prompt */
-    mvprintw(ed->screen_height - 1, 0, "^F Qidirish  ^C Bekor: ");
-    clrtoeol();
-    refresh();
+    /* The view to return to when the query matches nothing or is cancelled */
+    int saved_y = ed->cursor_y, saved_x = ed->cursor_x, saved_preferred = ed->preferred_x;
+    int saved_sel[5] = { ed->sel_active, ed->sel_start_y, ed->sel_start_x, ed->sel_end_y, ed->sel_end_x };
+    size_t origin = line_offset(ed, ed->cursor_y) + ed->cursor_x + 1;
+    SearchLevel *levels = calloc(256, sizeof(SearchLevel));
+    int showing = 0;
+    size_t shown = 0;
     
-    /* Manual input reading */
+    /* Manual input reading - scan a chunk whenever no key is waiting */
     while (1) {
+        SearchLevel *lv = (input_pos > 0) ? &levels[input_pos] : NULL;
+        int busy = lv ? search_level_step(ed, levels, input_pos, origin) : 0;
+        
+        /* Follow the nearest match so far */
+        int restore = showing && (!lv || (lv->count == 0 && !busy));
+        if (lv && lv->num_hits > 0 && (!showing || shown != lv->hits[0])) {
+            shown = lv->hits[0];
+            showing = 1;
+            search_show(ed, shown, finder_match_len(ed, &lv->finder, shown));
+            scroll_to_cursor(ed);
+            draw_screen(ed);
+        } else if (restore) {
+            showing = 0;
+            ed->cursor_y = saved_y;
+            ed->cursor_x = saved_x;
+            ed->sel_active = 0;
+            scroll_to_cursor(ed);
+            draw_screen(ed);
+        }
+        search_prompt(ed, query, lv, busy, regex);
+        
+        timeout(busy ? 0 : -1);
         ch = getch();
+        if (ch == ERR) continue;
         
         /* Check for exit keys */
         if (ch == '\n' || ch == '\r') {
             break;  /* Enter pressed */
         } else if (ch == 27 || ch == 3) {  /* ESC or Ctrl+C */
-            curs_set(1);
-            set_message(ed, "Cancelled");
-            debug_log("search: cancelled by %s", ch == 27 ? "ESC" : "Ctrl+C");
-            return;
+            break;
         } else if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
             if (input_pos > 0) {
+                /* Back to the cached set of the shorter query */
+                search_level_free(&levels[input_pos]);
                 input_pos--;
                 query[input_pos] = '\0';
-                /* Redraw entire line */
-                mvprintw(ed->screen_height - 1, 0, "^F Qidirish  ^C Bekor: %s ", query);
-                clrtoeol();
-                refresh();
             }
         } else if (ch >= 32 && ch < 127 && input_pos < 255) {
             query[input_pos++] = ch;
             query[input_pos] = '\0';
-            /* Redraw to show new character */
-            mvprintw(ed->screen_height - 1, 0, "^F Qidirish  ^C Bekor: %s", query);
-            refresh();
+            search_level_init(levels, input_pos, query, origin, regex);
+        } else if (ch == '\t') {
+            /* Every cached set belongs to the other mode - start them over */
+            regex = !regex;
+            for (int i = 1; i <= input_pos; i++) {
+                search_level_free(&levels[i]);
+                search_level_init(levels, i, query, origin, regex);
+            }
         }
     }
     
     /* Return to normal mode */
+    timeout(-1);
     curs_set(1);
-    
+    const char *error = (input_pos > 0) ? levels[input_pos].error : NULL;
+    for (int i = 1; i < 256; i++) {
+        if (levels[i].finder.needle) search_level_free(&levels[i]);
+    }
+    free(levels);
+    ed->cursor_y = saved_y;
+    ed->cursor_x = saved_x;
+    ed->preferred_x = saved_preferred;
+    ed->sel_active = saved_sel[0];
+    ed->sel_start_y = saved_sel[1];
+    ed->sel_start_x = saved_sel[2];
+    ed->sel_end_y = saved_sel[3];
+    ed->sel_end_x = saved_sel[4];
+    
+    if (ch == 27 || ch == 3) {
+        set_message(ed, "Cancelled");
+        debug_log("search: cancelled by %s", ch == 27 ? "ESC" : "Ctrl+C");
+        return;
+    }
     if (strlen(query) == 0) {
         set_message(ed, "Bekor qilindi");
         debug_log("search: cancelled");
         return;
     }
-    
-    debug_log("search: query='%s'", query);
-    
-    /* Count occurrences first */
-    int count = 0;
-    Line *line = ed->first_line;
-    int line_num = 0;
-    
-    while (line) {
-        char *ptr = line->data;
-        while ((ptr = strstr(ptr, query)) != NULL) {
-            count++;
-            ptr++;
-        }
-        line = line->next;
-        line_num++;
+    if (error) {
+        set_message(ed, error);
+        debug_log("search: bad regex: %s", error);
+        return;
     }
     
+    debug_log("search: %s='%s'", regex ? "regex" : "query", query);
+    load_finish(ed);
+    
+    /* Index every occurrence once - F3 / Shift+F3 step through them */
+    int count = match_start(ed, query, strlen(query), regex);
     if (count == 0) {
         set_message(ed, "Not found");
         debug_log("search: not found");
         return;
     }
-    
-    /* Show count */
-    char msg[128];
-    snprintf(msg, sizeof(msg), "Topildi: %d ta", count);
-    set_message(ed, msg);
     debug_log("search: found %d occurrences", count);
-    
-    /* Find first occurrence from current position */
-    line = ed->current_line;
-    line_num = ed->cursor_y;
-    
-    /* Search from cursor position in current line */
-    char *pos = strstr(&line->data[ed->cursor_x + 1], query);
-    if (pos) {
-        ed->cursor_x = pos - line->data;
-        ed->preferred_x = ed->cursor_x;
-        ed->sel_start_y = line_num;
-        ed->sel_start_x = ed->cursor_x;
-        ed->sel_end_y = line_num;
-        ed->sel_end_x = ed->cursor_x + strlen(query);
-        ed->sel_active = 1;
-        debug_log("search: found at line=%d col=%d", line_num, ed->cursor_x);
+    search_next(ed, 1);
+}
+
+/* Move to the next (dir > 0) or previous match of the last query, wrapping around */
+void search_next(Editor *ed, int dir) {
+    MatchIndex *mi = &ed->matches;
+    if (!mi->active) {
+        search_text(ed);
         return;
     }
-    
-    /* Search from next lines */
-    line = line->next;
-    line_num++;
-    
-    while (line) {
-        pos = strstr(line->data, query);
-        if (pos) {
-            ed->current_line = line;
-            ed->cursor_y = line_num;
-            ed->cursor_x = pos - line->data;
-            ed->preferred_x = ed->cursor_x;
-            ed->sel_start_y = line_num;
-            ed->sel_start_x = ed->cursor_x;
-            ed->sel_end_y = line_num;
-            ed->sel_end_x = ed->cursor_x + strlen(query);
-            ed->sel_active = 1;
-            debug_log("search: found at line=%d col=%d", line_num, ed->cursor_x);
-            return;
-        }
-        line = line->next;
-        line_num++;
+    match_refresh(ed);
+    int total = fenwick_sum(mi->tree_hits, mi->num_blocks);
+    if (total == 0) {
+        set_message(ed, "Not found");
+        return;
     }
     
-    /* Search from beginning */
-    line = ed->first_line;
-    line_num = 0;
-    
-    while (line && line_num < ed->cursor_y) {
-        pos = strstr(line->data, query);
-        if (pos) {
-            ed->current_line = line;
-            ed->cursor_y = line_num;
-            ed->cursor_x = pos - line->data;
-            ed->preferred_x = ed->cursor_x;
-            ed->sel_start_y = line_num;
-            ed->sel_start_x = ed->cursor_x;
-            ed->sel_end_y = line_num;
-            ed->sel_end_x = ed->cursor_x + strlen(query);
-            ed->sel_active = 1;
-            debug_log("search: found at line=%d col=%d (wrapped)", line_num, ed->cursor_x);
-            return;
-        }
-        line = line->next;
-        line_num++;
-    }
+    int k = (dir > 0) ? match_rank(ed, ed->cursor_y, ed->cursor_x, 1)
+                      : match_rank(ed, ed->cursor_y, ed->cursor_x, 0) - 1;
+    int wrapped = (k < 0 || k >= total);
+    if (k >= total) k = 0;
+    if (k < 0) k = total - 1;
+    
+    int y, x;
+    match_at(ed, k, &y, &x);
+    ed->cursor_y = y;
+    ed->cursor_x = x;
+    ed->preferred_x = x;
+    ed->sel_start_y = y;
+    ed->sel_start_x = x;
+    ed->sel_end_y = y;
+    ed->sel_end_x = x + finder_match_len(ed, &mi->finder, line_offset(ed, y) + x);
+    ed->sel_active = 1;
+    debug_log("search: match %d of %d at line=%d col=%d%s", k + 1, total, y, x, wrapped ? " (wrapped)" : "");
 }
 
 /* Replace text */
 void replace_text(Editor *ed) {
     debug_log("replace_text: starting");
+    load_finish(ed);
     
     /* Input mode - NO echo */
     curs_set(2);
@@ -2054,18 +6084,17 @@ void replace_text(Editor *ed) {
     
     /* Count occurrences */
     int count = 0;
-    Line *line = ed->first_line;
+    int query_len = strlen(query);
+    int repl_len = strlen(replacement);
+    Finder finder;
+    finder_init(&finder, query, query_len);
     
-    while (line) {
-        char *ptr = line->data;
-        while ((ptr = strstr(ptr, query)) != NULL) {
-            count++;
-            ptr++;
-        }
-        line = line->next;
-    }
+    size_t at, *hits = NULL;
+    count = doc_find_all(ed, &finder, &hits, search_threads());
     
     if (count == 0) {
+        free(hits);
+        finder_free(&finder);
         set_message(ed, "Not found");
         debug_log("replace: not found");
         return;
@@ -2085,67 +6114,36 @@ void replace_text(Editor *ed) {
     debug_log("replace: choice=%d (0x%02x)", choice, choice);
     
     if (choice == 27) { /* ESC */
+        free(hits);
+        finder_free(&finder);
         set_message(ed, "Bekor qilindi");
         return;
     }
     
-    save_undo(ed);
-    
     int replaced = 0;
-    int query_len = strlen(query);
-    int repl_len = strlen(replacement);
     
     if (choice == 'a' || choice == 'A') {
-        /* Replace all */
-        line = ed->first_line;
-        
-        while (line) {
-            char *pos;
-            while ((pos = strstr(line->data, query)) != NULL) {
-                int offset = pos - line->data;
-                
-                /* Allocate new buffer */
-                size_t new_len = line->len - query_len + repl_len;
-                if (new_len + 1 >= line->capacity) {
-                    line->capacity = new_len + 128;
-                    line->data = realloc(line->data, line->capacity);
-                }
-                
-                /* Move tail */
-                memmove(pos + repl_len, pos + query_len, strlen(pos + query_len) + 1);
-                /* Copy replacement */
-                memcpy(pos, replacement, repl_len);
-                line->len = new_len;
-                
-                replaced++;
-                pos = line->data + offset + repl_len;
-            }
-            line = line->next;
+        /* Replace all in one pass - matches left to right, skipping those overlapping the last one kept */
+        save_undo(ed);
+        for (int i = 0; i < count; i++) {
+            if (replaced == 0 || hits[i] >= hits[replaced - 1] + query_len) hits[replaced++] = hits[i];
         }
+        doc_replace_all(ed, hits, replaced, query_len, replacement, repl_len);
         
         snprintf(msg, sizeof(msg), "Almashtirildi: %d ta", replaced);
         set_message(ed, msg);
         ed->modified = 1;
         debug_log("replace: replaced %d occurrences", replaced);
     } else if (choice == '1') {
-        /* Replace one - find first from cursor */
-        line = ed->current_line;
-        
-        char *pos = strstr(&line->data[ed->cursor_x], query);
-        if (pos) {
-            int offset = pos - line->data;
-            size_t new_len = line->len - query_len + repl_len;
+        /* Replace one - find first from cursor on its line */
+        size_t start = line_offset(ed, ed->cursor_y);
+        size_t cursor = start + ed->cursor_x;
+        if (doc_find(ed, &finder, cursor, start + line_length(ed, ed->cursor_y), &at)) {
+            save_undo(ed);
+            doc_delete(ed, at, query_len);
+            doc_insert(ed, at, replacement, repl_len);
             
-            if (new_len + 1 >= line->capacity) {
-                line->capacity = new_len + 128;
-                line->data = realloc(line->data, line->capacity);
-            }
-            
-            memmove(pos + repl_len, pos + query_len, strlen(pos + query_len) + 1);
-            memcpy(pos, replacement, repl_len);
-            line->len = new_len;
-            
-            ed->cursor_x = offset + repl_len;
+            ed->cursor_x = at - start + repl_len;
             ed->preferred_x = ed->cursor_x;
             ed->modified = 1;
             
@@ -2153,12 +6151,30 @@ void replace_text(Editor *ed) {
             debug_log("replace: replaced 1 occurrence");
         }
     }
+    free(hits);
+    finder_free(&finder);
+}
+
+/* Drop the document text - its tree, the original buffer and the add chunks */
+static void doc_free(Editor *ed) {
+    piece_pool_reset();
+    ed->pieces = NULL;
+    orig_release(&ed->orig);
+    while (ed->add) {
+        TextBuf *next = ed->add->next;
+        free(ed->add->data);
+        free(ed->add->newlines);
+        free(ed->add->newlines_high);
+        free(ed->add);
+        ed->add = next;
+    }
 }
 
 /* Cleanup */
 void cleanup_editor(Editor *ed) {
-    /* Disable mouse motion tracking */
+    /* Disable mouse motion tracking and bracketed paste */
     printf("\033[?1003l");
+    printf("\033[?2004l");
     fflush(stdout);
     
     /* Clear any active selections */
@@ -2166,13 +6182,51 @@ void cleanup_editor(Editor *ed) {
     ed->mouse_pressed = 0;
     
     debug_log("cleanup_editor: cleaning up");
+    debug_log("Syntax checks: %lu run, %lu skipped", ed->syntax.runs, ed->syntax.skipped);
+    debug_log("Rows: %lu drawn, %lu unchanged", ed->render.drawn, ed->render.skipped);
+    
+    /* Stop the validation thread before the text it reads goes away */
+    if (ed->syntax.started) {
+        pthread_mutex_lock(&ed->syntax.lock);
+        __atomic_store_n(&ed->syntax.quit, 1, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&ed->syntax.cond);
+        pthread_mutex_unlock(&ed->syntax.lock);
+        pthread_join(ed->syntax.thread, NULL);
+        ed->syntax.started = 0;
+    }
+    syntax_job_release(&ed->syntax.job);
+    free(ed->syntax.edits);
     
-    Line *line = ed->first_line;
-    while (line) {
-        Line *next = line->next;
-        free(line->data);
-        free(line);
-        line = next;
+    doc_free(ed);
+    for (int i = 0; i < ed->undo_count + ed->redo_count; i++) {
+        undo_group_free(ed, history_at(ed, i));
+    }
+    free(ed->history);
+    free(ed->syntax.blocks);
+    free(ed->syntax.tree_lines);
+    free(ed->render.rows);
+    free(ed->render.cells);
+    for (int i = 0; i < ed->wrap.blocks_cap; i++) {
+        free(ed->wrap.blocks[i].wide);
+    }
+    free(ed->wrap.blocks);
+    free(ed->wrap.tree_lines);
+    free(ed->wrap.tree_rows);
+    free(ed->wrap.dirty);
+    match_stop(ed);
+    for (int i = 0; i < ed->matches.blocks_cap; i++) {
+        free(ed->matches.blocks[i].hits);
+    }
+    free(ed->matches.blocks);
+    free(ed->matches.tree_lines);
+    free(ed->matches.tree_hits);
+    free(ed->matches.dirty);
+    pthread_mutex_destroy(&ed->syntax.lock);
+    pthread_cond_destroy(&ed->syntax.cond);
+    
+    for (int i = 0; i < 2; i++) {
+        if (wake_pipe[i] >= 0) close(wake_pipe[i]);
+        wake_pipe[i] = -1;
     }
     
     if (ed->filename) free(ed->filename);
@@ -2188,21 +6242,509 @@ void cleanup_editor(Editor *ed) {
     free(ed->cut_buffer);
 }
 
+/* Load a whole file into an editor with no screen, for the benchmarks */
+static int bench_open(Editor *ed, const char *filename) {
+    memset(ed, 0, sizeof(Editor));
+    ed->total_lines = 1;
+    ed->undo_budget = UNDO_BUDGET;
+    pthread_mutex_init(&ed->syntax.lock, NULL);
+    pthread_cond_init(&ed->syntax.cond, NULL);
+    load_file(ed, filename);
+    load_finish(ed);
+    if (doc_length(ed) == 0) {
+        fprintf(stderr, "az: %s: empty or unreadable\n", filename);
+        return 0;
+    }
+    return 1;
+}
+
+static double bench_secs(const struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* Baseline: count the query the way search_text() used to, strstr() on each line made NUL-terminated */
+static void bench_strstr(Editor *ed, const char *query) {
+    size_t total = doc_length(ed), found = 0;
+    Line line = {0};
+    char *text = NULL;
+    size_t cap = 0;
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int y = 0; get_line_at(ed, y, &line); y++) {
+        if (line.len + 1 > cap) {
+            cap = line.len + 1024;
+            text = realloc(text, cap);
+        }
+        memcpy(text, line.data, line.len);
+        text[line.len] = '\0';
+        for (const char *at = text; (at = strstr(at, query)) != NULL; at++) {
+            found++;
+        }
+    }
+    double secs = bench_secs(&t0);
+    printf("strstr/line: %zu matches, %8.1f ms, %6.2f GB/s\n", found, secs * 1e3, total / secs / 1e9);
+    free(text);
+    line_release(&line);
+}
+
+/* az --bench-lines FILE: random line_offset() and line_at_offset() lookups, in ns each */
+static int bench_lines(const char *filename) {
+    Editor ed;
+    if (!bench_open(&ed, filename)) return 1;
+    size_t total = doc_length(&ed);
+    int lookups = 1000000;
+    unsigned long long seed = 88172645463325252ULL, sum = 0;
+    
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < lookups; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        sum += line_offset(&ed, (int)(seed % ed.total_lines));
+    }
+    double by_line = bench_secs(&t0) / lookups;
+    
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < lookups; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        sum += line_at_offset(&ed, seed % (total + 1));
+    }
+    double by_offset = bench_secs(&t0) / lookups;
+    
+    printf("%s: %zu bytes, %d lines, %d random lookups each (checksum %llu)\n",
+           filename, total, ed.total_lines, lookups, sum);
+    printf("line_offset:    %8.1f ns\nline_at_offset: %8.1f ns\n", by_line * 1e9, by_offset * 1e9);
+    return 0;
+}
+
+/* az --bench-search/--bench-regex FILE QUERY: whole-document count throughput per thread count, then the strstr baseline */
+static int bench_search(const char *filename, const char *query, int regex) {
+    Editor ed;
+    if (!bench_open(&ed, filename)) return 1;
+    size_t total = doc_length(&ed);
+    
+    Finder finder;
+    const char *error;
+    if (!regex) {
+        finder_init(&finder, query, strlen(query));
+    } else if (!finder_init_regex(&finder, query, strlen(query), &error)) {
+        fprintf(stderr, "az: %s: %s\n", query, error);
+        return 1;
+    }
+    int cpus = search_threads();
+    int counts[] = {1, 2, 4, cpus};
+    printf("%s: %zu bytes, %s '%s', %d CPUs online\n", filename, total, regex ? "regex" : "text", query, cpus);
+    for (int i = 0; i < 4; i++) {
+        if (i == 3 && (cpus == 1 || cpus == 2 || cpus == 4)) break;
+        double best = 0;
+        size_t found = 0;
+        for (int round = 0; round < 3; round++) {
+            struct timespec t0;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            found = doc_find_all(&ed, &finder, NULL, counts[i]);
+            double secs = bench_secs(&t0);
+            if (round == 0 || secs < best) best = secs;
+        }
+        printf("%3d threads: %zu matches, %8.1f ms, %6.2f GB/s\n",
+               counts[i], found, best * 1e3, total / best / 1e9);
+    }
+    finder_free(&finder);
+    if (!regex) bench_strstr(&ed, query);
+    return 0;
+}
+
+/* az --bench-replace FILE QUERY REPLACEMENT: replace-all, then undo and redo it */
+static int bench_replace(const char *filename, const char *query, const char *replacement) {
+    Editor ed;
+    if (!bench_open(&ed, filename)) return 1;
+    size_t total = doc_length(&ed), query_len = strlen(query), repl_len = strlen(replacement);
+    
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    Finder finder;
+    finder_init(&finder, query, query_len);
+    size_t *hits = NULL, found = doc_find_all(&ed, &finder, &hits, search_threads()), kept = 0;
+    for (size_t i = 0; i < found; i++) {
+        if (kept == 0 || hits[i] >= hits[kept - 1] + query_len) hits[kept++] = hits[i];
+    }
+    save_undo(&ed);
+    doc_replace_all(&ed, hits, kept, query_len, replacement, repl_len);
+    double replace_secs = bench_secs(&t0);
+    size_t expect = total - kept * query_len + kept * repl_len;
+    
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    perform_undo(&ed);
+    double undo_secs = bench_secs(&t0);
+    int undone = doc_length(&ed) == total;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    perform_redo(&ed);
+    double redo_secs = bench_secs(&t0);
+    
+    printf("%s: %zu bytes, '%s' -> '%s'\n", filename, total, query, replacement);
+    printf("replace all: %zu matches, %8.1f ms\n", kept, replace_secs * 1e3);
+    printf("undo:        %8.1f ms\nredo:        %8.1f ms\n", undo_secs * 1e3, redo_secs * 1e3);
+    free(hits);
+    finder_free(&finder);
+    if (!undone || doc_length(&ed) != expect) {
+        fprintf(stderr, "az: document length does not match\n");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * az --bench-render FILE: cost of a frame on a 300x100 screen with every
+ * row repainted, once in place and once paging down through the file.
+ * The terminal is a newterm() writing to /dev/null.
+ */
+static int bench_render(const char *filename) {
+    Editor ed;
+    if (!bench_open(&ed, filename)) return 1;
+    const char *term = getenv("TERM");
+    FILE *out = fopen("/dev/null", "w");
+    FILE *in = fopen("/dev/null", "r");
+    SCREEN *screen = (out && in) ? newterm(term && *term ? term : "xterm", out, in) : NULL;
+    if (!screen) {
+        fprintf(stderr, "az: cannot open a terminal for rendering\n");
+        if (out) fclose(out);
+        if (in) fclose(in);
+        return 1;
+    }
+    resizeterm(100, 300);
+    if (has_colors()) start_color();
+    getmaxyx(stdscr, ed.screen_height, ed.screen_width);
+    ed.edit_height = ed.screen_height - 2;
+    ed.edit_width = ed.screen_width - LINE_NUMBER_WIDTH - 1;
+    
+    /* A selection and an error span across the first screen, so every kind of run is drawn */
+    ed.sel_active = 1;
+    ed.sel_start_y = 2;
+    ed.sel_start_x = 5;
+    ed.sel_end_y = 60;
+    ed.sel_end_x = 10;
+    syntax_set_error(&ed.syntax_error, 30, 3, 20, "bench");
+    
+    int frames = 500;
+    double repaint = 0, paging = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < frames; i++) {
+            if (pass == 1) {
+                ed.offset_y = (int)((long long)i * ed.edit_height % ed.total_lines);
+                ed.offset_wrap = 0;
+            }
+            ed.render.num_rows = 0;
+            draw_screen(&ed);
+        }
+        *(pass == 0 ? &repaint : &paging) = bench_secs(&t0) / frames;
+    }
+    endwin();
+    delscreen(screen);
+    fclose(out);
+    fclose(in);
+    
+    printf("%s: %d lines, %dx%d screen\n", filename, ed.total_lines, ed.screen_width, ed.screen_height);
+    printf("repaint:   %8.3f ms per frame\npage down: %8.3f ms per frame\n", repaint * 1e3, paging * 1e3);
+    return 0;
+}
+
+/* az --bench-save FILE OUT: write the loaded document to OUT the way Ctrl+S does */
+static int bench_save(const char *filename, const char *out) {
+    Editor ed;
+    if (!bench_open(&ed, filename)) return 1;
+    size_t total = doc_length(&ed);
+    
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int err = doc_save(&ed, out);
+    double secs = bench_secs(&t0);
+    if (err) {
+        fprintf(stderr, "az: %s: %s\n", out, strerror(err));
+        return 1;
+    }
+    printf("%s: %zu bytes saved to %s in %8.1f ms, %6.2f GB/s\n", filename, total, out, secs * 1e3, total / secs / 1e9);
+    return 0;
+}
+
+/* Random ERE over the letters a.. plus '.', classes, groups and repeats; anchors only where POSIX means the same */
+static int selftest_pattern(char *p, int n, int depth, int letters, unsigned (*rnd)(void)) {
+    static const char *classes[] = { "[ab]", "[^a]", "[a-c]", "[^b\n]" };
+    int parts = 1 + rnd() % 3;
+    for (int i = 0; i < parts && n < 40; i++) {
+        int k = rnd() % 12;
+        if (k == 5) {
+            p[n++] = '.';
+        } else if (k == 6) {
+            for (const char *c = classes[rnd() % 4]; *c; c++) p[n++] = *c;
+        } else if (k == 7 && depth < 3) {
+            p[n++] = '(';
+            n = selftest_pattern(p, n, depth + 1, letters, rnd);
+            if (rnd() % 2) {
+                p[n++] = '|';
+                n = selftest_pattern(p, n, depth + 1, letters, rnd);
+            }
+            p[n++] = ')';
+        } else if (k == 8 && i == 0 && depth == 0 && n == 0) {
+            p[n++] = '^';
+            continue;
+        } else if (k == 9 && i == parts - 1 && depth == 0) {
+            p[n++] = '$';
+            continue;
+        } else {
+            p[n++] = 'a' + rnd() % letters;
+        }
+        int q = rnd() % 8;
+        if (q == 0) p[n++] = '*';
+        else if (q == 1) p[n++] = '+';
+        else if (q == 2) p[n++] = '?';
+        else if (q == 3) n += sprintf(p + n, "{%u,%u}", rnd() % 2, 1 + rnd() % 3);
+    }
+    return n;
+}
+
+static unsigned selftest_seed = 99;
+
+static unsigned selftest_rand(void) {
+    selftest_seed ^= selftest_seed << 13;
+    selftest_seed ^= selftest_seed >> 17;
+    selftest_seed ^= selftest_seed << 5;
+    return selftest_seed;
+}
+
+/*
+ * az --selftest-regex [ROUNDS]: differential test against the C library's
+ * regexec(), whose REG_EXTENDED matching is leftmost-longest as well.
+ * Each round edits a small document of a few letters and newlines into
+ * many pieces, then checks random patterns over random windows - start,
+ * length, NOTBOL/NOTEOL edges - and the full list from doc_find_all().
+ */
+static int selftest_regex(int rounds) {
+    int patterns = 0, searches = 0, rejected = 0;
+    for (int round = 0; round < rounds; round++) {
+        Editor ed;
+        memset(&ed, 0, sizeof(Editor));
+        ed.total_lines = 1;
+        int letters = 1 + selftest_rand() % 3;
+        for (int k = 0; k < 60; k++) {
+            char buf[8];
+            int n = selftest_rand() % 8;
+            for (int i = 0; i < n; i++) {
+                buf[i] = (selftest_rand() % 7 == 0) ? '\n' : 'a' + selftest_rand() % letters;
+            }
+            size_t len = doc_length(&ed);
+            doc_insert(&ed, len ? selftest_rand() % (len + 1) : 0, buf, n);
+            if (selftest_rand() % 5 == 0 && doc_length(&ed) > 2) {
+                doc_delete(&ed, selftest_rand() % (doc_length(&ed) - 1), 1);
+            }
+        }
+        size_t total = doc_length(&ed);
+        char *text = malloc(total + 1);
+        doc_read(&ed, 0, total, text);
+        text[total] = '\0';
+        
+        for (int q = 0; q < 10; q++) {
+            char pattern[128];
+            int len = selftest_pattern(pattern, 0, 0, letters, selftest_rand);
+            pattern[len] = '\0';
+            Finder f;
+            const char *error;
+            regex_t rx;
+            regmatch_t m = {0, 0};
+            if (regcomp(&rx, pattern, REG_EXTENDED | REG_NEWLINE) != 0) {
+                printf("FAIL: regcomp rejects '%s'\n", pattern);
+                return 1;
+            }
+            if (!finder_init_regex(&f, pattern, len, &error)) {
+                /* The only refusal is a pattern that can match nothing at all - so it matches "" */
+                int empty = regexec(&rx, "", 1, &m, 0) == 0;
+                regfree(&rx);
+                if (strcmp(error, "Matches empty text") != 0 || !empty) {
+                    printf("FAIL: '%s' rejected: %s\n", pattern, error);
+                    return 1;
+                }
+                rejected++;
+                continue;
+            }
+            patterns++;
+            
+            /* One search over a random window */
+            const char *fail = NULL;
+            size_t from = 0, to = 0, at = 0;
+            int want = 0, got = 0;
+            for (int t = 0; t < 8 && !fail; t++) {
+                from = selftest_rand() % (total + 1);
+                to = (selftest_rand() % 3) ? total : from + selftest_rand() % (total - from + 1);
+                got = doc_find(&ed, &f, from, to, &at);
+                char *window = strndup(text + from, to - from);
+                int flags = 0;
+                if (from > 0 && text[from - 1] != '\n') flags |= REG_NOTBOL;
+                if (to < total && text[to] != '\n') flags |= REG_NOTEOL;
+                want = regexec(&rx, window, 1, &m, flags) == 0;
+                free(window);
+                searches++;
+                if (want && m.rm_eo == m.rm_so) {
+                    fail = "empty regexec match";
+                } else if (want != got || (got && (at != from + m.rm_so || f.found_len != (size_t)(m.rm_eo - m.rm_so)))) {
+                    fail = "doc_find";
+                } else if (got && to == total && finder_match_len(&ed, &f, at) != f.found_len) {
+                    fail = "finder_match_len";
+                }
+            }
+            
+            /* Every match, each search resuming where the last match ended */
+            size_t *hits = NULL, count = 0;
+            if (!fail) {
+                count = doc_find_all(&ed, &f, &hits, 1 + selftest_rand() % 4);
+                size_t i = 0;
+                for (from = 0; from < total && !fail; i++) {
+                    int flags = (from > 0 && text[from - 1] != '\n') ? REG_NOTBOL : 0;
+                    if (regexec(&rx, text + from, 1, &m, flags) != 0) break;
+                    if (m.rm_eo == m.rm_so) fail = "empty regexec match";
+                    else if (i >= count || hits[i] != from + m.rm_so) fail = "doc_find_all";
+                    from += m.rm_eo;
+                }
+                if (!fail && i != count) fail = "doc_find_all";
+                free(hits);
+            }
+            regfree(&rx);
+            finder_free(&f);
+            if (fail) {
+                printf("FAIL: %s, round %d, pattern '%s', window %zu..%zu: got %d at %zu len %zu, regexec %d at %zu len %zu\ntext: ",
+                       fail, round, pattern, from, to, got, at, f.found_len, want,
+                       from + (size_t)m.rm_so, (size_t)(m.rm_eo - m.rm_so));
+                for (size_t i = 0; i < total; i++) putchar(text[i] == '\n' ? '|' : text[i]);
+                putchar('\n');
+                return 1;
+            }
+        }
+        free(text);
+        doc_free(&ed);
+    }
+    printf("regex selftest: %d patterns (%d rejected), %d searches, all agree with regexec\n",
+           patterns, rejected, searches);
+    return 0;
+}
+
 /* Main */
 int main(int argc, char *argv[]) {
     Editor ed;
     const char *filename = (argc > 1) ? argv[1] : NULL;
     
+    if (argc == 4 && strcmp(argv[1], "--bench-search") == 0) {
+        return bench_search(argv[2], argv[3], 0);
+    }
+    if (argc == 4 && strcmp(argv[1], "--bench-regex") == 0) {
+        return bench_search(argv[2], argv[3], 1);
+    }
+    if (argc == 5 && strcmp(argv[1], "--bench-replace") == 0) {
+        return bench_replace(argv[2], argv[3], argv[4]);
+    }
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "--selftest-regex") == 0) {
+        return selftest_regex(argc == 3 ? atoi(argv[2]) : 2000);
+    }
+    if (argc == 3 && strcmp(argv[1], "--bench-lines") == 0) {
+        return bench_lines(argv[2]);
+    }
+    if (argc == 3 && strcmp(argv[1], "--bench-render") == 0) {
+        return bench_render(argv[2]);
+    }
+    if (argc == 4 && strcmp(argv[1], "--bench-save") == 0) {
+        return bench_save(argv[2], argv[3]);
+    }
+    
     init_editor(&ed, filename);
     
     debug_log("Entering main loop");
     
+    check_syntax_error(&ed);
+    
+    /* Sleep until something happens; draw only when it changed what is on screen */
+    int redraw = 1;
+    int pending = 0;  /* A batch of keys was cut short - more are waiting */
     while (1) {
-        draw_screen(&ed);
-        int ch = getch();
-        if (ch != ERR) {
-            debug_log("Got key: %d", ch);
+        /* Start a due validation, take a finished one */
+        unsigned long checked = ed.syntax.revision;
+        int busy = syntax_service(&ed);
+        if (ed.syntax.revision != checked) redraw = 1;
+        
+        long long now = now_ms();
+        if (ed.message_until && now >= ed.message_until) {
+            ed.message_until = 0;
+            redraw = 1;
+        }
+        
+        if (redraw) {
+            draw_screen(&ed);
+            redraw = 0;
+        }
+        
+        /* Block until a key, the wake pipe or the next deadline; keep loading while idle */
+        int loading = ed.load_pos < ed.load_end;
+        long long deadline = ed.message_until;
+        if (ed.syntax.due_ms && !busy && (!deadline || ed.syntax.due_ms < deadline)) {
+            deadline = ed.syntax.due_ms;
+        }
+        int wait = -1;
+        if (loading || pending) {
+            wait = 0;
+        } else if (deadline) {
+            wait = deadline > now ? (int)(deadline - now) : 0;
+        }
+        struct pollfd fds[2] = {
+            { STDIN_FILENO, POLLIN, 0 },
+            { wake_pipe[0], POLLIN, 0 },
+        };
+        int ready = poll(fds, wake_pipe[0] >= 0 ? 2 : 1, wait);
+        if (ready > 0 && (fds[1].revents & POLLIN)) {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {
+                /* Wake-ups carry no data */
+            }
+        }
+        if (resize_pending) {
+            handle_resize(&ed);
+            redraw = 1;
+        }
+        
+        /*
+         * Keys - ncurses may already hold some it read, so ask it rather than
+         * the fd.  A burst is applied whole and drawn as one frame, but not for
+         * longer than INPUT_BATCH_MS, so a steady stream still shows progress.
+         */
+        int ch, keys = 0;
+        long long batch_end = now_ms() + INPUT_BATCH_MS;
+        pending = 0;
+        while ((ch = getch()) != ERR) {
+            keys++;
+            unsigned long revision = ed.revision;
+            timeout(-1);  /* Prompts inside wait for their keys */
             handle_input(&ed, ch);
+            timeout(0);
+            scroll_to_cursor(&ed);
+            redraw = 1;
+            
+            /* Text changed - validate once the keys stop coming */
+            if (ed.revision != revision) {
+                request_syntax_check(&ed);
+            }
+            if (now_ms() >= batch_end) {
+                pending = 1;
+                break;
+            }
+        }
+        if (keys > 1) debug_log("Batch: %d keys%s", keys, pending ? ", more waiting" : "");
+        
+        if (loading && ready == 0 && !pending) {
+            if (!load_more(&ed, LOAD_CHUNK_SIZE)) {
+                ed.syntax.due_ms = now_ms();
+            }
+            redraw = 1;
         }
     }
     